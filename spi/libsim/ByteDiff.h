@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBSIM_X86 1
+#endif
+
+// "Which bytes are different?" between two packed snapshots. Used to find the
+// watched 8 bit signals that changed since the last tick without looking at
+// each one. Same deal as DeadlineScan.h: scalar, SSE2 and AVX2 versions, best
+// one picked at runtime.
+//
+// n has to be a multiple of `pad`, callers keep their buffers padded with
+// bytes that are equal in both. The indices that differ go into `changed` in
+// order and the count is returned.
+
+namespace libsim {
+namespace diff {
+
+constexpr size_t pad = 32;
+
+using Kernel = size_t (*)(uint8_t const* a, uint8_t const* b, size_t n,
+                          uint32_t* changed);
+
+inline size_t scalar(uint8_t const* a, uint8_t const* b, size_t n,
+                     uint32_t* changed)
+{
+  size_t count = 0;
+
+  // 8 at a time, almost nothing changes on most ticks
+  for (size_t i = 0; i < n; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x == y) continue;
+
+    for (size_t j = i; j < i + 8; ++j) {
+      if (a[j] != b[j]) changed[count++] = j;
+    }
+  }
+
+  return count;
+}
+
+#ifdef LIBSIM_X86
+
+__attribute__((target("sse2")))
+inline size_t sse2(uint8_t const* a, uint8_t const* b, size_t n,
+                   uint32_t* changed)
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; i += 16) {
+    __m128i x    = _mm_loadu_si128((__m128i const*)(a + i));
+    __m128i y    = _mm_loadu_si128((__m128i const*)(b + i));
+    unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+
+    while (mask) {
+      changed[count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t avx2(uint8_t const* a, uint8_t const* b, size_t n,
+                   uint32_t* changed)
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i  x    = _mm256_loadu_si256((__m256i const*)(a + i));
+    __m256i  y    = _mm256_loadu_si256((__m256i const*)(b + i));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+    while (mask) {
+      changed[count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  return count;
+}
+
+#endif // LIBSIM_X86
+
+inline Kernel best()
+{
+#ifdef LIBSIM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return avx2;
+  if (__builtin_cpu_supports("sse2")) return sse2;
+#endif
+  return scalar;
+}
+
+} // namespace diff
+
+// Packed copies of a bunch of single byte values that live all over the
+// place. Reading them is still one load each, but finding out which ones
+// changed is a diff of two flat buffers.
+class ByteSnapshot {
+public:
+  // Returns the lane the value ended up in
+  uint32_t add(uint8_t const* ptr) {
+    uint32_t lane = ptrs_.size();
+    ptrs_.push_back(ptr);
+
+    size_t padded = (ptrs_.size() + diff::pad - 1) / diff::pad * diff::pad;
+    if (padded > prev_.size()) {
+      prev_.resize(padded, 0);
+      now_.resize(padded, 0);
+      changed_.resize(padded);
+    }
+
+    refresh(lane);
+    return lane;
+  }
+
+  // Reads everything, returns how many lanes changed since the last time
+  size_t sample() {
+    // locals, otherwise every byte store might have changed the vectors
+    uint8_t*              now  = now_.data();
+    uint8_t const* const* ptrs = ptrs_.data();
+    size_t                n    = ptrs_.size();
+    for (size_t i = 0; i < n; ++i) now[i] = *ptrs[i];
+
+    size_t count = kernel_(prev_.data(), now_.data(), prev_.size(), changed_.data());
+    prev_.swap(now_); // now_ goes stale, gets overwritten next time
+    return count;
+  }
+
+  uint32_t changed(size_t k)     const { return changed_[k]; }
+  uint8_t  value(uint32_t lane)  const { return prev_[lane]; }
+  void     refresh(uint32_t lane)      { prev_[lane] = now_[lane] = *ptrs_[lane]; }
+
+private:
+  diff::Kernel                kernel_ = diff::best();
+  std::vector<uint8_t const*> ptrs_;
+  std::vector<uint8_t>        prev_;    // padded, the padding is always 0
+  std::vector<uint8_t>        now_;
+  std::vector<uint32_t>       changed_; // scratch
+};
+
+} // namespace libsim
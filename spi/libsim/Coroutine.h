@@ -0,0 +1,235 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "Coroutine.h needs C++20, the rest of libsim is fine with C++17"
+#endif
+
+#include "Simulator.h"
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Machines written as straight-line code instead of a state per step:
+//
+//   CoMachine master(FramePool&, spi* s, uint8_t value) {
+//     s->SSEL = 1;
+//     for (int bit = 7; bit >= 0; --bit) {
+//       co_await Timeout{10};
+//       s->MOSI = value >> bit & 1;
+//       s->SCK  = 1;
+//       co_await Timeout{10};
+//       s->SCK  = 0;
+//     }
+//   }
+//
+//   FramePool pool; // one per simulator, has to outlive its machines
+//   auto m   = master(pool, s, 111);
+//   auto sim = SimBuilder<>().add(m).get_sim();
+//
+// The body starts on the InitEvent, like any other machine's first
+// transition, and runs until it co_awaits something. Anything a transition
+// could return can be awaited, except AllOf (that would resume it more than
+// once) and None (that would never resume it at all). co_await hands back the
+// event that fired, which is mostly interesting after a OneOf:
+//
+//   auto ev = co_await OneOf{RisingEdge{&s->out_avail}, Timeout{1000}};
+//   if (std::holds_alternative<Timeout>(ev)) ...
+//
+// Once the body returns the machine doesn't wait on anything anymore.
+// Exceptions come out of whatever poll resumed it, same as from a transition.
+//
+// The simulator resumes the coroutine straight from its dispatch table (see
+// has_resume), no transitions table and no visiting. The first argument has
+// to be the FramePool the frame comes out of. Can't be checkpointed.
+
+namespace libsim {
+
+// Hands out coroutine frames. Frames are rounded up to a multiple of `grain`
+// and freed frames go on a list per size, so a testbench that keeps starting
+// the same few coroutines stops allocating after the first few. Anything over
+// max_pooled goes to the regular heap. Not thread safe, same as the
+// simulator.
+class FramePool {
+public:
+  static constexpr size_t grain       = 64;
+  static constexpr size_t max_pooled  = 4096;
+  static constexpr size_t chunk_bytes = 64 << 10;
+
+  FramePool() = default;
+
+  FramePool(FramePool const&)            = delete;
+  FramePool& operator=(FramePool const&) = delete;
+
+  void* allocate(size_t n) {
+    live_ += 1;
+
+    size_t c = size_class(n);
+    if (c >= classes) return ::operator new(n);
+
+    if (Free* f = free_[c]) {
+      free_[c] = f->next;
+      return f;
+    }
+
+    size_t bytes = c * grain;
+    if (left_ < bytes) {
+      chunks_.emplace_back(new std::byte[chunk_bytes]);
+      next_ = chunks_.back().get();
+      left_ = chunk_bytes;
+    }
+
+    void* p = next_;
+    next_ += bytes;
+    left_ -= bytes;
+    return p;
+  }
+
+  void deallocate(void* p, size_t n) {
+    live_ -= 1;
+
+    size_t c = size_class(n);
+    if (c >= classes) {
+      ::operator delete(p);
+      return;
+    }
+
+    free_[c] = new (p) Free{free_[c]};
+  }
+
+  size_t live()   const { return live_; }          // frames still in use
+  size_t chunks() const { return chunks_.size(); } // times it had to allocate
+
+private:
+  static constexpr size_t classes = max_pooled / grain + 1;
+
+  static size_t size_class(size_t n) { return (n + grain - 1) / grain; }
+
+  struct Free {
+    Free* next;
+  };
+
+  std::array<Free*, classes>                free_{};
+  std::vector<std::unique_ptr<std::byte[]>> chunks_;
+  std::byte*                                next_ = nullptr;
+  size_t                                    left_ = 0;
+  size_t                                    live_ = 0;
+};
+
+class CoMachine {
+public:
+  MAKE_STATE(Running);
+  MAKE_STATE(Finished);
+
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  // The frame remembers which pool it came from, in front of itself
+  struct promise_type {
+    static constexpr size_t header = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    static_assert(header >= sizeof(FramePool*));
+
+    template <typename... Args>
+    static void* operator new(size_t n, FramePool& pool, Args const&...) {
+      auto* p = static_cast<std::byte*>(pool.allocate(n + header));
+      *reinterpret_cast<FramePool**>(p) = &pool;
+      return p + header;
+    }
+
+    static void operator delete(void* frame, size_t n) {
+      auto* p = static_cast<std::byte*>(frame) - header;
+      (*reinterpret_cast<FramePool**>(p))->deallocate(p, n + header);
+    }
+
+    CoMachine get_return_object() { return CoMachine(Handle::from_promise(*this)); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend()   noexcept { return {}; }
+
+    void return_void() { next = None{}; }
+
+    void unhandled_exception() {
+      next  = None{};
+      error = std::current_exception();
+    }
+
+    struct Awaiter {
+      promise_type& p;
+
+      bool          await_ready() const noexcept { return false; }
+      void          await_suspend(Handle) const noexcept { }
+      SimpleEvent&& await_resume() const noexcept { return std::move(*p.fired); }
+    };
+
+    template <typename E>
+    Awaiter await_transform(E&& e) {
+      using T = std::decay_t<E>;
+      static_assert(!std::is_same_v<T, AllOf>, "AllOf would resume more than once");
+      static_assert(!std::is_same_v<T, None>,  "None would never resume");
+
+      if constexpr (std::is_same_v<T, Only> || std::is_same_v<T, OneOf>) {
+        next = std::forward<E>(e);
+      }
+      else {
+        next = Only{std::forward<E>(e)};
+      }
+      return Awaiter{*this};
+    }
+
+    Events             next = None{}; // what to wait on, set right before suspending
+    SimpleEvent*       fired = nullptr;
+    std::exception_ptr error;
+  };
+
+  CoMachine(CoMachine&& o) noexcept
+    : state(o.state)
+    , handle_(std::exchange(o.handle_, nullptr))
+  { }
+
+  CoMachine& operator=(CoMachine&& o) noexcept {
+    if (this != &o) {
+      if (handle_) handle_.destroy();
+      state   = o.state;
+      handle_ = std::exchange(o.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  ~CoMachine() {
+    if (handle_) handle_.destroy();
+  }
+
+  // Runs the body up to its next co_await, see has_resume. `ev` only has to
+  // last until then, await_resume moves it out if anyone wants it
+  Events resume(SimpleEvent& ev) {
+    if (!handle_ || handle_.done()) return None{};
+
+    promise_type& p = handle_.promise();
+    p.fired = &ev;
+    state   = Running{};
+    handle_.resume();
+
+    if (handle_.done()) state = Finished{};
+    if (p.error) std::rethrow_exception(std::exchange(p.error, nullptr));
+    return std::move(p.next);
+  }
+
+  bool done() const { return state.index() == 2; }
+
+  auto const& currentState() const { return state; }
+
+  States<Running, Finished> state = Uninitialized{};
+
+private:
+  explicit CoMachine(Handle h) : handle_(h) { }
+
+  Handle handle_;
+};
+
+} // namespace libsim
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBSIM_X86 1
+#endif
+
+// "Which of these deadlines are <= now?" over a flat array, plus the earliest
+// of the ones that aren't. Used by TimerScan. Comes in scalar, SSE4.2 and AVX2
+// flavors, the best one the cpu has gets picked at runtime so the binary still
+// runs on whatever it gets copied to.
+//
+// All of them write the indices of the due deadlines into `due` (in order),
+// return how many there were and leave the earliest remaining deadline in
+// `next` (UINT64_MAX if there isn't one).
+
+namespace libsim {
+namespace scan {
+
+using Kernel = size_t (*)(uint64_t const* deadlines, size_t n, uint64_t now,
+                          uint32_t* due, uint64_t& next);
+
+inline size_t scalar(uint64_t const* deadlines, size_t n, uint64_t now,
+                     uint32_t* due, uint64_t& next)
+{
+  size_t   count    = 0;
+  uint64_t earliest = UINT64_MAX;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (deadlines[i] <= now) due[count++] = i;
+    else if (deadlines[i] < earliest) earliest = deadlines[i];
+  }
+
+  next = earliest;
+  return count;
+}
+
+#ifdef LIBSIM_X86
+
+// There are only signed 64 bit compares, flipping the top bit makes them work
+// for unsigned values. UINT64_MAX flips to INT64_MAX.
+//
+// The two vector versions are the same loop at different widths
+
+__attribute__((target("sse4.2")))
+inline size_t sse42(uint64_t const* deadlines, size_t n, uint64_t now,
+                    uint32_t* due, uint64_t& next)
+{
+  __m128i const bias = _mm_set1_epi64x(INT64_MIN);
+  __m128i const vnow = _mm_xor_si128(_mm_set1_epi64x(now), bias);
+  __m128i const none = _mm_set1_epi64x(INT64_MAX);
+  __m128i       vmin = none;
+
+  size_t count = 0, i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v     = _mm_loadu_si128((__m128i const*)(deadlines + i));
+    v             = _mm_xor_si128(v, bias);
+    __m128i later = _mm_cmpgt_epi64(v, vnow);
+
+    // only timers that stay behind count towards the next deadline
+    __m128i cand = _mm_blendv_epi8(none, v, later);
+    vmin = _mm_blendv_epi8(vmin, cand, _mm_cmpgt_epi64(vmin, cand));
+
+    unsigned mask = ~_mm_movemask_pd(_mm_castsi128_pd(later)) & 0x3;
+    while (mask) {
+      due[count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  alignas(16) int64_t lanes[2];
+  _mm_store_si128((__m128i*)lanes, vmin);
+  uint64_t earliest = (uint64_t)(lanes[0] < lanes[1] ? lanes[0] : lanes[1]) ^ (1ull << 63);
+
+  uint64_t tail;
+  size_t   more = scalar(deadlines + i, n - i, now, due + count, tail);
+  for (size_t j = 0; j < more; ++j) due[count + j] += i;
+
+  next = tail < earliest ? tail : earliest;
+  return count + more;
+}
+
+__attribute__((target("avx2")))
+inline size_t avx2(uint64_t const* deadlines, size_t n, uint64_t now,
+                   uint32_t* due, uint64_t& next)
+{
+  __m256i const bias = _mm256_set1_epi64x(INT64_MIN);
+  __m256i const vnow = _mm256_xor_si256(_mm256_set1_epi64x(now), bias);
+  __m256i const none = _mm256_set1_epi64x(INT64_MAX);
+  __m256i       vmin = none;
+
+  size_t count = 0, i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v     = _mm256_loadu_si256((__m256i const*)(deadlines + i));
+    v             = _mm256_xor_si256(v, bias);
+    __m256i later = _mm256_cmpgt_epi64(v, vnow);
+
+    __m256i cand = _mm256_blendv_epi8(none, v, later);
+    vmin = _mm256_blendv_epi8(vmin, cand, _mm256_cmpgt_epi64(vmin, cand));
+
+    unsigned mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(later)) & 0xf;
+    while (mask) {
+      due[count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  alignas(32) int64_t lanes[4];
+  _mm256_store_si256((__m256i*)lanes, vmin);
+  int64_t low = lanes[0];
+  for (int64_t l : lanes) low = l < low ? l : low;
+  uint64_t earliest = (uint64_t)low ^ (1ull << 63);
+
+  uint64_t tail;
+  size_t   more = scalar(deadlines + i, n - i, now, due + count, tail);
+  for (size_t j = 0; j < more; ++j) due[count + j] += i;
+
+  next = tail < earliest ? tail : earliest;
+  return count + more;
+}
+
+#endif // LIBSIM_X86
+
+inline Kernel best()
+{
+#ifdef LIBSIM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))   return avx2;
+  if (__builtin_cpu_supports("sse4.2")) return sse42;
+#endif
+  return scalar;
+}
+
+} // namespace scan
+} // namespace libsim
@@ -0,0 +1,562 @@
+#pragma once
+
+#include "Simulator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// A bunch of Simulators (partitions) that only talk to each other through
+// links, each one running on its own thread. This is plain conservative
+// parallel discrete event simulation (Chandy/Misra/Bryant): a partition only
+// runs a tick once nothing upstream can change what it will see during it,
+// and nobody waits on a global barrier.
+//
+// A link copies a value from one partition into another, `latency` ticks
+// later: whatever the source holds at the end of tick t lands in the
+// destination right before tick t + latency. A latency of 1 behaves exactly
+// like having both machines in one Simulator, bigger ones are what lets the
+// partitions run ahead of each other. Machines watch the destination with
+// edge events like any other value.
+//
+// Partitions that have time skipping on (and are idle) also tell their
+// neighbours how long they are going to stay quiet, based on their next
+// Timeout and their own inputs (the null messages of CMB). So a partition
+// that's asleep doesn't hold everyone else back to its own clock.
+//
+// Or nobody waits at all, see FederationOptions::optimistic.
+//
+// Results don't depend on the threads at all, run_for(ticks, false) runs the
+// exact same thing round robin on the calling thread.
+
+namespace libsim {
+
+struct FederationOptions {
+  // Time Warp instead of waiting. Partitions run as far ahead as they like,
+  // saving their state every few ticks (Simulator::checkpoint, see
+  // has_checkpoint for what that takes from machines). A value that shows up
+  // for a tick that already ran rolls the partition back to before it, and
+  // everything it sent since then gets taken back, which may roll back
+  // whoever got it, and so on. Pays off when partitions hardly ever actually
+  // change each other's inputs.
+  //
+  // The oldest tick anybody could still go back to (GVT) gets worked out on
+  // the side, and saved states and inputs from before it are thrown away.
+  bool optimistic = false;
+
+  // Optimistic only: how far past GVT a partition may get. Bounds the memory
+  // (and the work thrown away by a rollback)
+  uint64_t window = 256;
+
+  // Optimistic only: ticks between saved states. Rolling back goes to the
+  // last save before the late value and runs forward from there
+  uint64_t save_every = 8;
+};
+
+class Federation {
+public:
+  Federation(FederationOptions opts = {}) : opts_(opts) {
+    if (opts_.window == 0 || opts_.save_every == 0) {
+      throw std::logic_error("window and save_every have to be at least 1");
+    }
+  }
+
+  Federation(Federation const&)            = delete;
+  Federation& operator=(Federation const&) = delete;
+
+  // Adds a partition and returns its index. The federation only keeps a
+  // reference, the simulator has to stick around
+  template <typename Sim>
+  size_t add(Sim& sim) {
+    parts_.push_back(std::make_unique<Part>(std::make_unique<Driver<Sim>>(sim)));
+    return parts_.size() - 1;
+  }
+
+  // *dst (in partition `to`) follows *src (in partition `from`), latency ticks
+  // behind. src should only be written by machines in `from`, and dst should
+  // only be written by this link
+  template <typename T>
+  void link(size_t from, T const* src, size_t to, T* dst, uint64_t latency) {
+    static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= 8,
+                  "links carry plain values of up to 8 bytes");
+    if (latency == 0) throw std::logic_error("links need a latency of at least 1");
+    if (from >= parts_.size() || to >= parts_.size() || from == to) {
+      throw std::logic_error("links go between two different partitions");
+    }
+
+    auto l = std::make_unique<Link>();
+    l->from    = from;
+    l->to      = to;
+    l->src     = src;
+    l->dst     = dst;
+    l->width   = sizeof(T);
+    l->latency = latency;
+    l->last    = read(*l);
+    memcpy(&l->base, dst, sizeof(T));
+
+    parts_[from]->out.push_back(l.get());
+    parts_[to]->in.push_back(l.get());
+    links_.push_back(std::move(l));
+  }
+
+  // Runs every partition forward by `ticks`. All of them have to be at the
+  // same time to start with
+  RunStats run_for(uint64_t ticks, bool threaded = true) {
+    if (parts_.empty()) return RunStats{ticks, 0};
+
+    uint64_t start = parts_[0]->driver->now();
+    for (auto& p : parts_) {
+      if (p->driver->now() != start) throw std::logic_error("partitions aren't in sync");
+      p->events = 0;
+      p->safe.store(start, std::memory_order_relaxed);
+    }
+    uint64_t end = start + ticks;
+
+    if (opts_.optimistic) begin_optimistic(start);
+
+    // optimistic partitions can get sent back even after reaching the end
+    auto busy = [&](Part& p) {
+      return opts_.optimistic ? gvt_.load() < end : p.driver->now() < end;
+    };
+    auto advance = [&](Part& p) {
+      return opts_.optimistic ? step_optimistic(p, end) : step(p, end);
+    };
+
+    if (threaded && parts_.size() > 1) {
+      std::vector<std::thread> threads;
+      for (auto& p : parts_) {
+        threads.emplace_back([&, part = p.get()] {
+          while (busy(*part)) {
+            if (!advance(*part)) std::this_thread::yield();
+          }
+        });
+      }
+      for (auto& t : threads) t.join();
+    }
+    else {
+      bool any = true;
+      while (any) {
+        any = false;
+        for (auto& p : parts_) {
+          if (busy(*p)) {
+            advance(*p);
+            any = true;
+          }
+        }
+      }
+    }
+
+    uint64_t events = 0;
+    for (auto& p : parts_) events += p->events;
+    return RunStats{ticks, events};
+  }
+
+  // Optimistic only: how many times a partition had to go back, over every
+  // run_for so far
+  uint64_t rollbacks() const { return rollbacks_.load(); }
+
+private:
+  // Just enough of a Simulator to drive it, whatever its machines are
+  struct Partition {
+    virtual ~Partition() = default;
+    virtual uint64_t now()                   = 0;
+    virtual RunStats run_for(uint64_t ticks) = 0;
+    virtual bool     settled()               = 0;
+    virtual uint64_t next_timer()            = 0;
+    virtual void     poke()                  = 0;
+
+    // Saved states for optimistic mode, each one along with the number of
+    // events taken up to that point
+
+    // saves the state as of now()
+    virtual void     save(uint64_t events)   = 0;
+    // back to the latest save at or before `tick`, returns its events
+    virtual uint64_t rollback(uint64_t tick) = 0;
+    // drops everything before the latest save at or before `tick`
+    virtual void     fossils(uint64_t tick)  = 0;
+    virtual void     forget()                = 0;
+    virtual uint64_t oldest()                = 0;
+  };
+
+  template <typename Sim>
+  struct Driver : Partition {
+    Driver(Sim& sim) : sim(sim) { }
+
+    uint64_t now()                   override { return sim.now(); }
+    RunStats run_for(uint64_t ticks) override { return sim.run_for(ticks); }
+    bool     settled()               override { return sim.settled(); }
+    uint64_t next_timer()            override { return sim.next_timer(); }
+    void     poke()                  override { sim.poke(); }
+
+    void save(uint64_t events) override {
+      saved.push_back(Saved{sim.now(), events, sim.checkpoint()});
+    }
+
+    uint64_t rollback(uint64_t tick) override {
+      while (saved.size() > 1 && saved.back().tick > tick) saved.pop_back();
+      if (saved.back().tick > tick) throw std::logic_error("rolled back past GVT");
+
+      sim.restore(saved.back().state);
+      return saved.back().events;
+    }
+
+    void fossils(uint64_t tick) override {
+      while (saved.size() > 1 && saved[1].tick <= tick) saved.pop_front();
+    }
+
+    void     forget() override { saved.clear(); }
+    uint64_t oldest() override { return saved.front().tick; }
+
+    struct Saved {
+      uint64_t                                    tick;
+      uint64_t                                    events;
+      decltype(std::declval<Sim&>().checkpoint()) state;
+    };
+
+    Sim&              sim;
+    std::deque<Saved> saved;
+  };
+
+  struct Delivery {
+    uint64_t when;  // tick it has to be in place for
+    uint64_t value;
+  };
+
+  // What optimistic partitions send each other
+  struct Message {
+    uint64_t when;
+    uint64_t sent;  // tick that wrote the value
+    uint64_t value;
+  };
+
+  struct Link;
+
+  // Something for an optimistic partition's inbox: a value, or an
+  // anti-message ("forget everything I sent from tick msg.sent on", when is
+  // the earliest tick that can touch)
+  struct Op {
+    Link*   link;
+    bool    cancel;
+    Message msg;
+  };
+
+  struct Link {
+    size_t      from;
+    size_t      to;
+    void const* src;
+    void*       dst;
+    size_t      width;
+    uint64_t    latency;
+    uint64_t    last;     // last value sent, only touched by `from`
+
+    // conservative
+    std::mutex           mutex;
+    std::deque<Delivery> queue;
+
+    // optimistic. sent_until belongs to `from`, the rest to `to`
+    uint64_t             sent_until = 0; // 1 + the latest tick that sent something
+    uint64_t             base       = 0; // dst before the first message in got
+    std::deque<Message>  got;            // in order
+    size_t               next       = 0; // first one that isn't in dst yet
+  };
+
+  struct Part {
+    Part(std::unique_ptr<Partition> d) : driver(std::move(d)) { }
+
+    std::unique_ptr<Partition> driver;
+    std::vector<Link*>         in;
+    std::vector<Link*>         out;
+    uint64_t                   events = 0;
+
+    // Outputs for every tick before this are final. Only ever goes up
+    std::atomic<uint64_t> safe{0};
+
+    // Optimistic. Anybody can post to the inbox, lvt is never later than
+    // anything in there or than where we are
+    std::mutex            mutex;
+    std::vector<Op>       inbox;
+    std::vector<Op>       ops;           // scratch
+    std::atomic<uint64_t> lvt{0};
+    uint64_t              next_save = 0;
+    uint64_t              coast     = 0; // don't send anything before this
+    uint64_t              steps     = 0;
+  };
+
+  static uint64_t read(Link const& l) {
+    uint64_t v = 0;
+    memcpy(&v, l.src, l.width);
+    return v;
+  }
+
+  // One move for one partition: run a tick, jump over some idle ones, or
+  // find out we have to wait. Returns false if we're stuck waiting
+  bool step(Part& p, uint64_t end) {
+    uint64_t now = p.driver->now();
+
+    // Everything upstream is final before `horizon`, so deliveries for any
+    // tick before that are already queued up. Has to be looked at before the
+    // queues
+    uint64_t horizon = end;
+    for (Link* l : p.in) {
+      uint64_t safe = parts_[l->from]->safe.load(std::memory_order_acquire);
+      horizon = std::min(horizon, sat_add(safe, l->latency));
+    }
+
+    uint64_t next_delivery = UINT64_MAX;
+    for (Link* l : p.in) {
+      std::lock_guard<std::mutex> lock(l->mutex);
+      while (!l->queue.empty() && l->queue.front().when <= now) {
+        memcpy(l->dst, &l->queue.front().value, l->width);
+        l->queue.pop_front();
+        p.driver->poke();
+      }
+      if (!l->queue.empty()) next_delivery = std::min(next_delivery, l->queue.front().when);
+    }
+
+    if (now >= horizon) {
+      publish(p, horizon, next_delivery);
+      return false;
+    }
+
+    // nothing is going to happen for a while, skip right to it
+    if (p.driver->settled()) {
+      uint64_t until = std::min({p.driver->next_timer(), horizon, next_delivery, end});
+      if (until > now) {
+        p.events += p.driver->run_for(until - now).events;
+        publish(p, horizon, next_delivery);
+        return true;
+      }
+    }
+
+    p.events += p.driver->run_for(1).events;
+
+    // whatever changed during that tick shows up downstream `latency` later
+    for (Link* l : p.out) {
+      uint64_t v = read(*l);
+      if (v == l->last) continue;
+      l->last = v;
+
+      std::lock_guard<std::mutex> lock(l->mutex);
+      l->queue.push_back(Delivery{now + l->latency, v});
+    }
+
+    publish(p, horizon, next_delivery);
+    return true;
+  }
+
+  // Tells everyone downstream how far along we are. If we're idle we won't
+  // run (so won't write anything) before our next timer or our next input
+  void publish(Part& p, uint64_t horizon, uint64_t next_delivery) {
+    uint64_t safe = p.driver->now();
+    if (p.driver->settled()) {
+      safe = std::max(safe, std::min({p.driver->next_timer(), horizon, next_delivery}));
+    }
+
+    if (safe > p.safe.load(std::memory_order_relaxed)) {
+      p.safe.store(safe, std::memory_order_release);
+    }
+  }
+
+  // Time Warp from here on.
+  //
+  // GVT is the minimum of every partition's lvt. A partition only gets sent
+  // back by something in its inbox, and posting there lowers its lvt right
+  // away, so the minimum holds as long as nothing got posted while we were
+  // reading them all (posted_ says). Whatever gets posted later comes from a
+  // tick no earlier than its sender's lvt, so it can't go below it either.
+
+  void begin_optimistic(uint64_t start) {
+    gvt_.store(start);
+    for (auto& p : parts_) {
+      absorb(*p); // leftovers for after `start`, can't send anyone back
+      p->driver->forget();
+      p->driver->save(0);
+      p->next_save = start + opts_.save_every;
+      p->coast     = start;
+      p->lvt.store(start);
+      for (Link* l : p->in) fossils(*l, start);
+    }
+  }
+
+  bool step_optimistic(Part& p, uint64_t end) {
+    absorb(p);
+
+    uint64_t now   = p.driver->now();
+    uint64_t until = std::min(end, sat_add(gvt_.load(), opts_.window));
+
+    if (now >= until || (++p.steps & 63) == 0) update_gvt(p);
+    if (now >= until) {
+      announce(p);
+      return false;
+    }
+
+    if (now >= p.next_save) {
+      p.driver->save(p.events);
+      p.next_save = now + opts_.save_every;
+    }
+
+    uint64_t next_input = UINT64_MAX;
+    for (Link* l : p.in) {
+      while (l->next < l->got.size() && l->got[l->next].when <= now) {
+        memcpy(l->dst, &l->got[l->next].value, l->width);
+        l->next += 1;
+        p.driver->poke();
+      }
+      if (l->next < l->got.size()) next_input = std::min(next_input, l->got[l->next].when);
+    }
+
+    if (p.driver->settled()) {
+      uint64_t skip = std::min({p.driver->next_timer(), next_input, until});
+      if (skip > now) {
+        p.events += p.driver->run_for(skip - now).events;
+        announce(p);
+        return true;
+      }
+    }
+
+    p.events += p.driver->run_for(1).events;
+
+    for (Link* l : p.out) {
+      uint64_t v = read(*l);
+      if (v == l->last) continue;
+      l->last = v;
+
+      // after a rollback the ticks before the late value send the same things
+      // as last time, and those never got taken back
+      if (now < p.coast) continue;
+      l->sent_until = now + 1;
+      post(*l, Op{l, false, Message{now + l->latency, now, v}});
+    }
+
+    announce(p);
+    return true;
+  }
+
+  void post(Link& l, Op const& op) {
+    Part& to = *parts_[l.to];
+    {
+      std::lock_guard<std::mutex> lock(to.mutex);
+      to.inbox.push_back(op);
+      if (op.msg.when < to.lvt.load()) to.lvt.store(op.msg.when);
+    }
+    posted_.fetch_add(1);
+  }
+
+  // Moves whatever got posted to us into the links, going back in time if
+  // some of it is for a tick that already ran
+  void absorb(Part& p) {
+    p.ops.clear();
+    {
+      std::lock_guard<std::mutex> lock(p.mutex);
+      p.ops.swap(p.inbox);
+    }
+
+    uint64_t now  = p.driver->now();
+    uint64_t back = UINT64_MAX;
+    for (Op const& op : p.ops) {
+      Link& l = *op.link;
+
+      if (op.cancel) {
+        // everything comes in order, so it's always the tail that goes
+        size_t keep = l.got.size();
+        while (keep > 0 && l.got[keep - 1].sent >= op.msg.sent) keep -= 1;
+        if (keep == l.got.size()) continue;
+
+        if (l.got[keep].when < now) back = std::min(back, l.got[keep].when);
+        l.got.resize(keep);
+        l.next = std::min(l.next, keep);
+      }
+      else {
+        if (op.msg.when < now) back = std::min(back, op.msg.when);
+        l.got.push_back(op.msg);
+      }
+    }
+
+    if (back != UINT64_MAX) rollback(p, back);
+  }
+
+  // Back to before tick `tick` ran
+  void rollback(Part& p, uint64_t tick) {
+    rollbacks_.fetch_add(1, std::memory_order_relaxed);
+
+    p.events = p.driver->rollback(tick);
+    uint64_t now = p.driver->now();
+    p.next_save  = now + opts_.save_every;
+    p.coast      = tick;
+
+    // inputs as they were back then
+    for (Link* l : p.in) {
+      uint64_t v = l->base;
+      l->next    = 0;
+      while (l->next < l->got.size() && l->got[l->next].when < now) {
+        v = l->got[l->next].value;
+        l->next += 1;
+      }
+      memcpy(l->dst, &v, l->width);
+    }
+
+    // and take back whatever we said from `tick` on
+    for (Link* l : p.out) {
+      l->last = read(*l);
+      if (l->sent_until <= tick) continue;
+
+      l->sent_until = tick;
+      post(*l, Op{l, true, Message{tick + l->latency, tick, 0}});
+    }
+  }
+
+  // where we are, or earlier if the inbox says so
+  void announce(Part& p) {
+    std::lock_guard<std::mutex> lock(p.mutex);
+    uint64_t lvt = p.driver->now();
+    for (Op const& op : p.inbox) lvt = std::min(lvt, op.msg.when);
+    p.lvt.store(lvt);
+  }
+
+  // Anybody can do this, but only cleans up after the partition it's called
+  // for
+  void update_gvt(Part& p) {
+    uint64_t before = posted_.load();
+    uint64_t low    = UINT64_MAX;
+    for (auto& q : parts_) low = std::min(low, q->lvt.load());
+    if (posted_.load() != before) return; // try again later
+
+    uint64_t gvt = gvt_.load();
+    while (low > gvt && !gvt_.compare_exchange_weak(gvt, low)) { }
+
+    p.driver->fossils(gvt_.load());
+    uint64_t oldest = p.driver->oldest();
+    for (Link* l : p.in) fossils(*l, oldest);
+  }
+
+  // Values from before `tick` that are already in dst only matter as the
+  // one to go back to
+  static void fossils(Link& l, uint64_t tick) {
+    while (l.next > 0 && l.got.front().when < tick) {
+      l.base = l.got.front().value;
+      l.got.pop_front();
+      l.next -= 1;
+    }
+  }
+
+  static uint64_t sat_add(uint64_t a, uint64_t b) {
+    return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+  }
+
+  FederationOptions                  opts_;
+  std::vector<std::unique_ptr<Part>> parts_;
+  std::vector<std::unique_ptr<Link>> links_;
+
+  std::atomic<uint64_t> gvt_{0};
+  std::atomic<uint64_t> posted_{0};
+  std::atomic<uint64_t> rollbacks_{0};
+};
+
+} // namespace libsim
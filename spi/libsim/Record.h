@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+// Log of every event a Simulator fired, see Simulator::record and
+// Simulator::replay. Each one is five varints:
+//
+//   tick - tick of the one before
+//   machine index
+//   state index << 4 | event kind (index in SimpleEvent)
+//   user_id
+//   event_id
+//
+// so a typical event takes 5 or 6 bytes. A stream starts with `magic`.
+
+namespace libsim {
+
+struct FiredEvent {
+  uint64_t tick;
+  uint32_t machine;
+  uint32_t state;    // of the machine, right before the transition
+  uint32_t kind;
+  uint64_t user_id;
+  uint64_t event_id;
+};
+
+namespace record {
+
+constexpr char   magic[8]   = {'l', 's', 'i', 'm', 'r', 'e', 'c', '1'};
+constexpr size_t max_record = 5 * 10; // five varints of at most 10 bytes
+constexpr size_t kind_bits  = 4;
+
+inline uint8_t* put(uint8_t* p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+} // namespace record
+
+// Collects records in memory, and either keeps them (bytes()) or writes them
+// to a stream every chunk_bytes.
+class Recorder {
+public:
+  static constexpr size_t chunk_bytes = 64 << 10;
+
+  Recorder() { grow(chunk_bytes); }
+
+  explicit Recorder(std::ostream& out) : out_(&out) {
+    grow(chunk_bytes);
+    out.write(record::magic, sizeof(record::magic));
+  }
+
+  Recorder(Recorder const&)            = delete;
+  Recorder& operator=(Recorder const&) = delete;
+
+  ~Recorder() { flush(); }
+
+  void add(FiredEvent const& f) {
+    if (cap_ - len_ < record::max_record) make_room();
+
+    uint8_t* p = buf_.get() + len_;
+    p = record::put(p, f.tick - tick_);
+    p = record::put(p, f.machine);
+    p = record::put(p, (uint64_t)f.state << record::kind_bits | f.kind);
+    p = record::put(p, f.user_id);
+    p = record::put(p, f.event_id);
+    len_  = p - buf_.get();
+    tick_ = f.tick;
+    count_ += 1;
+  }
+
+  // Writes out whatever is buffered. Does nothing without a stream
+  void flush() {
+    if (!out_ || len_ == 0) return;
+    out_->write((char const*)buf_.get(), len_);
+    out_->flush();
+    len_ = 0;
+  }
+
+  uint64_t count() const { return count_; }
+
+  // Everything so far, magic included. Only without a stream
+  std::vector<uint8_t> bytes() const {
+    if (out_) throw std::logic_error("recording went to a stream");
+    std::vector<uint8_t> b(record::magic, record::magic + sizeof(record::magic));
+    b.insert(b.end(), buf_.get(), buf_.get() + len_);
+    return b;
+  }
+
+private:
+  void make_room() {
+    if (out_) flush();
+    else      grow(cap_ * 2);
+  }
+
+  void grow(size_t cap) {
+    std::unique_ptr<uint8_t[]> bigger(new uint8_t[cap]);
+    if (len_) memcpy(bigger.get(), buf_.get(), len_);
+    buf_ = std::move(bigger);
+    cap_ = cap;
+  }
+
+  std::ostream*              out_   = nullptr;
+  std::unique_ptr<uint8_t[]> buf_;
+  size_t                     len_   = 0;
+  size_t                     cap_   = 0;
+  uint64_t                   tick_  = 0; // of the last record
+  uint64_t                   count_ = 0;
+};
+
+// Reads records back
+class Playback {
+public:
+  explicit Playback(std::vector<uint8_t> bytes) : bytes_(std::move(bytes)) {
+    check();
+  }
+
+  explicit Playback(std::istream& in)
+    : bytes_(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>())
+  {
+    check();
+  }
+
+  // false at the end
+  bool next(FiredEvent& f) {
+    if (pos_ == bytes_.size()) return false;
+
+    tick_    += get();
+    f.tick    = tick_;
+    f.machine = get();
+    uint64_t sk = get();
+    f.state   = sk >> record::kind_bits;
+    f.kind    = sk & ((1u << record::kind_bits) - 1);
+    f.user_id  = get();
+    f.event_id = get();
+    return true;
+  }
+
+private:
+  void check() {
+    if (bytes_.size() < sizeof(record::magic) ||
+        memcmp(bytes_.data(), record::magic, sizeof(record::magic)) != 0) {
+      throw std::runtime_error("not a libsim recording");
+    }
+    pos_ = sizeof(record::magic);
+  }
+
+  uint64_t get() {
+    uint64_t v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (pos_ == bytes_.size()) throw std::runtime_error("recording is cut short");
+      uint8_t b = bytes_[pos_++];
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    throw std::runtime_error("recording is garbled");
+  }
+
+  std::vector<uint8_t> bytes_;
+  size_t               pos_  = 0;
+  uint64_t             tick_ = 0;
+};
+
+} // namespace libsim
@@ -1,9 +1,28 @@
 #pragma once
 
-#include <variant>
+#include "ByteDiff.h"
+#include "Record.h"
+#include "SmallVec.h"
+#include "Stats.h"
+#include "Timers.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <exception>
+#include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <tuple>
 #include <type_traits>
-#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
 
 // This is not the way I usually write code, I promise!
 
@@ -24,7 +43,7 @@ struct StateBase {
   char const* human_readable;
 };
 
-std::ostream& operator<<(std::ostream& os, StateBase& s)
+inline std::ostream& operator<<(std::ostream& os, StateBase const& s)
 {
   return (os << s.human_readable);
 }
@@ -38,13 +57,10 @@ using States = std::variant<Uninitialized, StateList...>;
 // All events have an ID.
 // IDs must be globally unique for the machine (across all types of events)
 // If no ID is assigned by the user, the simulator will assign one
-// A single event might cancel other events for the same machine (by id) if it
-// is completed.
 struct EventBase {
   EventBase(char const* h, uint64_t user_id)
     : human_readable(h)
     , event_id(0)
-    , canceled(false)
     , user_id(user_id) // optional
   { }
 
@@ -54,13 +70,10 @@ struct EventBase {
   char const* human_readable;
   uint64_t    event_id;
 
-  bool                  canceled;
-  std::vector<uint64_t> cancel_on_complete;
-
   uint64_t user_id;
 };
 
-std::ostream& operator<<(std::ostream& os, EventBase& e)
+inline std::ostream& operator<<(std::ostream& os, EventBase const& e)
 {
   return (os << e.human_readable);
 }
@@ -93,44 +106,65 @@ enum class HiLow {
   Low,
 };
 
-template <typename T>
-struct DefaultEval;
+// Custom evaluators are plain function pointers, so watching a value never
+// costs more than an indirect call (and usually not even that)
+using Evaluator = HiLow (*)(void const*);
 
-template<>
-struct DefaultEval<bool>
+// Reads an unsigned integer that is `width` bytes wide. Anything that isn't 1,
+// 2, 4 or 8 bytes reads as 0.
+inline uint64_t load_value(void const* ptr, size_t width)
 {
-  HiLow operator()(void const* ptr) const {
-    bool b = *static_cast<bool const*>(ptr);
-    if (b) return HiLow::Hi;
-    else   return HiLow::Low;
+  switch (width) {
+    case 1: { uint8_t  v; memcpy(&v, ptr, 1); return v; }
+    case 2: { uint16_t v; memcpy(&v, ptr, 2); return v; }
+    case 4: { uint32_t v; memcpy(&v, ptr, 4); return v; }
+    case 8: { uint64_t v; memcpy(&v, ptr, 8); return v; }
+    default: return 0;
   }
-};
+}
 
-template<>
-struct DefaultEval<uint8_t>
-{
-  HiLow operator()(void const* ptr) const {
-    uint8_t b = *static_cast<uint8_t const*>(ptr);
-    if (b) return HiLow::Hi;
-    else   return HiLow::Low;
+// Common bits of the edge events. Without an evaluator the watched value is
+// treated as an integer and anything non-zero is Hi, which the simulator can
+// check on the value it already loaded without calling anything.
+struct EdgeBase : public EventBase {
+  template <typename T>
+  EdgeBase(char const* h, T const* valuePtr, uint64_t user_id, Evaluator eval)
+    : EventBase(h, user_id)
+    , ptr((void const*)valuePtr)
+    , width(sizeof(T))
+    , eval(eval)
+    , last(level(load_value(ptr, width)))
+  {
+    if (!eval && !std::is_integral_v<T>) {
+      throw std::logic_error("Need an Evaluator to watch a non-integer");
+    }
+  }
+
+  // value is whatever is at ptr right now
+  HiLow level(uint64_t value) const {
+    if (eval)  return eval(ptr);
+    if (value) return HiLow::Hi;
+    else       return HiLow::Low;
   }
+
+  void const* ptr;
+  size_t      width; // of *ptr, to notice changes
+  Evaluator   eval;
+  HiLow       last;
 };
 
-struct RisingEdge : public EventBase {
+struct RisingEdge : public EdgeBase {
   using is_event = std::true_type;
 
   template <typename T>
-  RisingEdge(T const* valuePtr,
-             uint64_t event_id=0,
-             std::function<HiLow(void const*)> eval = DefaultEval<T>{})
-    : EventBase("RisingEdge", event_id)
-    , ptr((void const*)valuePtr)
-    , last(eval(ptr))
-    , eval(eval)
+  RisingEdge(T const* valuePtr, uint64_t event_id=0, Evaluator eval=nullptr)
+    : EdgeBase("RisingEdge", valuePtr, event_id, eval)
   { }
 
-  bool satisfied(uint64_t) {
-    HiLow now = eval(ptr);
+  bool satisfied(uint64_t) { return fires(load_value(ptr, width)); }
+
+  bool fires(uint64_t value) {
+    HiLow now = level(value);
     if (last == HiLow::Low && now == HiLow::Hi) {
       return true;
     }
@@ -139,27 +173,20 @@ struct RisingEdge : public EventBase {
       return false;
     }
   }
-
-  void const*                       ptr;
-  HiLow                             last;
-  std::function<HiLow(void const*)> eval;
 };
 
-struct FallingEdge : public EventBase {
+struct FallingEdge : public EdgeBase {
   using is_event = std::true_type;
 
   template <typename T>
-  FallingEdge(T const* valuePtr,
-              uint64_t event_id=0,
-              std::function<HiLow(void const*)> eval = DefaultEval<T>{})
-    : EventBase("FallingEdge", event_id)
-    , ptr((void const*)valuePtr)
-    , last(eval(ptr))
-    , eval(eval)
+  FallingEdge(T const* valuePtr, uint64_t event_id=0, Evaluator eval=nullptr)
+    : EdgeBase("FallingEdge", valuePtr, event_id, eval)
   { }
 
-  bool satisfied(uint64_t) {
-    HiLow now = eval(ptr);
+  bool satisfied(uint64_t) { return fires(load_value(ptr, width)); }
+
+  bool fires(uint64_t value) {
+    HiLow now = level(value);
     if (last == HiLow::Hi && now == HiLow::Low) {
       return true;
     }
@@ -168,16 +195,134 @@ struct FallingEdge : public EventBase {
       return false;
     }
   }
+};
+
+// Common bits of the events that look at what a value is rather than wait
+// for it to flip, so the simulator can decide without waking anybody up.
+// Values of 1, 2, 4 or 8 bytes (CData to QData) are compared as integers.
+// Anything bigger is read as 32 bit words with the least significant one
+// first, the way Verilator lays out WData. Those get looked at every tick,
+// and masks and values only reach their low 64 bits.
+struct ValueBase : public EventBase {
+  template <typename T>
+  ValueBase(char const* h, T const* valuePtr, uint64_t mask, uint64_t value,
+            uint64_t user_id)
+    : EventBase(h, user_id)
+    , ptr((void const*)valuePtr)
+    , width(sizeof(T))
+    , mask(mask)
+    , value(value)
+  {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(std::is_integral_v<T> || sizeof(T) % 4 == 0,
+                  "wide values have to be 32 bit words, like WData");
+  }
+
+  // loaded is whatever the simulator read from ptr, which is only the real
+  // thing for widths it knows about. `high` is set if anything past the low
+  // 64 bits is
+  uint64_t read(uint64_t loaded, bool& high) const {
+    high = false;
+    if (width <= 8) return loaded;
+
+    auto const* words = static_cast<uint32_t const*>(ptr);
+    for (size_t w = 2; w < width / 4; ++w) high |= words[w] != 0;
+    return (uint64_t)words[1] << 32 | words[0];
+  }
+
+  // Everything, squashed into 64 bits. The value itself if it fits, wider
+  // ones get hashed
+  uint64_t fingerprint(uint64_t loaded) const {
+    if (width <= 8) return loaded;
+
+    auto const* words = static_cast<uint32_t const*>(ptr);
+    uint64_t    h     = 0;
+    for (size_t w = 0; w < width / 4; ++w) {
+      h = (h ^ words[w]) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 29;
+    }
+    return h;
+  }
+
+  void const* ptr;
+  size_t      width; // of *ptr, in bytes
+  uint64_t    mask;
+  uint64_t    value;
+};
+
+// Fires once the value is anything but 0, right away if it already is
+struct Level : public ValueBase {
+  using is_event = std::true_type;
+
+  template <typename T>
+  Level(T const* valuePtr, uint64_t event_id=0)
+    : ValueBase("Level", valuePtr, ~0ull, 0, event_id)
+  { }
+
+  bool fires(uint64_t loaded) const {
+    bool high;
+    return read(loaded, high) != 0 || high;
+  }
+};
+
+// Fires once the value is `value`, right away if it already is
+struct Equals : public ValueBase {
+  using is_event = std::true_type;
+
+  template <typename T>
+  Equals(T const* valuePtr, uint64_t value, uint64_t event_id=0)
+    : ValueBase("Equals", valuePtr, ~0ull, value, event_id)
+  { }
+
+  bool fires(uint64_t loaded) const {
+    bool high;
+    return read(loaded, high) == value && !high;
+  }
+};
 
-  void const*                       ptr;
-  HiLow                             last;
-  std::function<HiLow(void const*)> eval;
+// Fires once (value & mask) == match, right away if it already is
+struct MaskMatch : public ValueBase {
+  using is_event = std::true_type;
+
+  template <typename T>
+  MaskMatch(T const* valuePtr, uint64_t mask, uint64_t match, uint64_t event_id=0)
+    : ValueBase("MaskMatch", valuePtr, mask, match, event_id)
+  { }
+
+  bool fires(uint64_t loaded) const {
+    bool high;
+    return (read(loaded, high) & mask) == value;
+  }
+};
+
+// Fires once the value is different from what it was when this was created.
+// Wide values are compared by hash, so a change could in theory slip by
+struct Changed : public ValueBase {
+  using is_event = std::true_type;
+
+  template <typename T>
+  Changed(T const* valuePtr, uint64_t event_id=0)
+    : ValueBase("Changed", valuePtr, ~0ull, 0, event_id)
+  {
+    value = fingerprint(load_value(ptr, width));
+  }
+
+  bool fires(uint64_t loaded) const { return fingerprint(loaded) != value; }
 };
 
 using SimpleEvent = std::variant<InitEvent,
                                  Timeout,
                                  RisingEdge,
-                                 FallingEdge>;
+                                 FallingEdge,
+                                 Level,
+                                 Equals,
+                                 MaskMatch,
+                                 Changed>;
+
+// Anything that sits on a value instead of the timer queue
+template <typename T>
+constexpr bool is_watcher = std::is_base_of_v<EdgeBase, T> ||
+                            std::is_base_of_v<ValueBase, T>;
 
 // Does nothing
 struct None { };
@@ -185,24 +330,32 @@ struct None { };
 // Only one event allowed
 struct Only { SimpleEvent ev; };
 
+// Room for this many events before a list has to go to the heap. Almost
+// everything waits on one to three things at a time
+constexpr size_t inline_events = 4;
+
+using EventList = SmallVec<SimpleEvent, inline_events>;
+
 // Fires all of the events in the list
 struct AllOf {
   template <typename... Args>
-  AllOf(Args&&... args)
-   : events({std::forward<Args>(args)...})
-  { }
+  AllOf(Args&&... args) {
+    events.reserve(sizeof...(Args));
+    (events.emplace_back(std::forward<Args>(args)), ...);
+  }
 
-  std::vector<SimpleEvent> events;
+  EventList events;
 };
 
 // Exactly one event can fire, others are canceled if any fires
 struct OneOf {
   template <typename... Args>
-  OneOf(Args&&... args)
-   : events({std::forward<Args>(args)...})
-  { }
+  OneOf(Args&&... args) {
+    events.reserve(sizeof...(Args));
+    (events.emplace_back(std::forward<Args>(args)), ...);
+  }
 
-  std::vector<SimpleEvent> events;
+  EventList events;
 };
 
 using Events = std::variant<None, Only, AllOf, OneOf>;
@@ -233,9 +386,12 @@ static_assert(
     "!");
 } // namespace test
 
+// States are only ever looked at, events are handed over to the machine.
+// Neither one gets copied on the way there (unless the transition takes them
+// by value, and copying them is cheap).
 template <typename M, typename S, typename E>
 typename std::enable_if<!has_transition<M, S, E>::value, Events>::type
-_invoke(M&, S s, E e) {
+_invoke(M&, S const& s, E&& e) {
   static_assert(S::is_state::value);
   static_assert(E::is_event::value);
   std::stringstream ss;
@@ -251,121 +407,1119 @@ _invoke(M&, S s, E e) {
 
 template <typename M, typename S, typename E>
 typename std::enable_if<has_transition<M, S, E>::value, Events>::type
-_invoke(M& m, S s, E e) {
+_invoke(M& m, S const& s, E&& e) {
   static_assert(S::is_state::value);
   static_assert(E::is_event::value);
-  return m.transition(s, e);
+  return m.transition(s, std::move(e));
+}
+
+// Whatever variant the machine keeps its state in
+template <typename M>
+using StateOf = std::decay_t<decltype(std::declval<M const&>().currentState())>;
+
+// Flat [state][event] table of transitions for one machine type, built at
+// compile time. Dispatching is two variant index loads and an indirect call
+// instead of a visit inside of a visit. Missing transitions point at the
+// throwing _invoke, and can be counted (or static_asserted on) with `missing`.
+template <typename M>
+struct Transitions {
+  using StateVariant = StateOf<M>;
+  using Fn           = Events (*)(M&, StateVariant const&, SimpleEvent&);
+
+  static constexpr size_t states = std::variant_size_v<StateVariant>;
+  static constexpr size_t events = std::variant_size_v<SimpleEvent>;
+
+  template <size_t S, size_t E>
+  using has = has_transition<M,
+                             std::variant_alternative_t<S, StateVariant>,
+                             std::variant_alternative_t<E, SimpleEvent>>;
+
+  // is there a transition for this [state index][event index]?
+  static constexpr bool defined(size_t s, size_t e) { return defined_[s][e]; }
+
+  static constexpr size_t missing = [] {
+    size_t n = 0;
+    for (size_t s = 0; s < states; ++s) {
+      for (size_t e = 0; e < events; ++e) n += !defined(s, e);
+    }
+    return n;
+  }();
+
+  static Events dispatch(M& m, StateVariant const& s, SimpleEvent& e) {
+    return table_[s.index()][e.index()](m, s, e);
+  }
+
+private:
+  template <size_t S, size_t E>
+  static Events entry(M& m, StateVariant const& s, SimpleEvent& e) {
+    return _invoke(m, *std::get_if<S>(&s), std::move(*std::get_if<E>(&e)));
+  }
+
+  template <size_t S, size_t... Es>
+  static constexpr std::array<Fn, events> row(std::index_sequence<Es...>) {
+    return {&entry<S, Es>...};
+  }
+
+  template <size_t S, size_t... Es>
+  static constexpr std::array<bool, events> defined_row(std::index_sequence<Es...>) {
+    return {has<S, Es>::value...};
+  }
+
+  template <size_t... Ss>
+  static constexpr auto make_table(std::index_sequence<Ss...>) {
+    using Row = std::array<Fn, events>;
+    return std::array<Row, states>{row<Ss>(std::make_index_sequence<events>{})...};
+  }
+
+  template <size_t... Ss>
+  static constexpr auto make_defined(std::index_sequence<Ss...>) {
+    using Row = std::array<bool, events>;
+    return std::array<Row, states>{defined_row<Ss>(std::make_index_sequence<events>{})...};
+  }
+
+  static constexpr auto table_   = make_table(std::make_index_sequence<states>{});
+  static constexpr auto defined_ = make_defined(std::make_index_sequence<states>{});
+};
+
+// Machines that keep track of where they are on their own (see Coroutine.h)
+// skip all of the above and get every event handed straight to
+//
+//   Events resume(SimpleEvent&);
+template <typename M, typename = void>
+struct has_resume : std::false_type {};
+
+template <typename M>
+struct has_resume<M, std::void_t<decltype(std::declval<M&>().resume(std::declval<SimpleEvent&>()))>>
+  : std::true_type {};
+
+// How Simulator::checkpoint() saves a machine. By default it's a plain copy of
+// the whole thing. Machines that can't (or shouldn't) be copied, say because
+// they drive a verilated model or hang on to a bunch of memory, opt in with
+//
+//   Whatever checkpoint() const;
+//   void     restore(Whatever const&);
+//
+// and save only what they need to get back to where they were.
+template <typename M, typename = void>
+struct has_checkpoint : std::false_type {};
+
+template <typename M>
+struct has_checkpoint<M, std::void_t<decltype(std::declval<M const&>().checkpoint())>>
+  : std::true_type {};
+
+template <typename M>
+auto checkpoint_machine(M const& m) {
+  if constexpr (has_checkpoint<M>::value) {
+    return m.checkpoint();
+  }
+  else {
+    static_assert(std::is_copy_assignable_v<M>,
+                  "machine has to be copyable or have checkpoint()/restore()");
+    return m;
+  }
+}
+
+template <typename M, typename Saved>
+void restore_machine(M& m, Saved const& saved) {
+  if constexpr (has_checkpoint<M>::value) m.restore(saved);
+  else                                    m = saved;
 }
 
 template <typename... MachineList>
 class SimBuilder;
 
+enum class TimerBackend {
+  Heap,  // binary heap, O(log n) everything
+  Wheel, // hierarchical timing wheel, O(1) add/cancel/expire
+  Scan,  // flat arrays + SIMD scan, for a handful of busy timers
+};
+
+// Knobs picked when building the simulator, see the matching SimBuilder methods
+struct SimOptions {
+  TimerBackend timers = TimerBackend::Heap;
+
+  // When nothing can possibly happen before the next timer deadline, jump
+  // straight to it instead of ticking there one poll at a time.
+  //
+  // Only valid if every value watched by an edge event is written by a machine
+  // (or never written at all). Values written from outside of the simulator
+  // between polls still get noticed, but time may have jumped ahead first
+  // (unless whoever wrote them calls Simulator::poke).
+  bool time_skipping = false;
+
+  // Run each tick's transitions on this many threads (counting the one
+  // calling poll). Machines are split into groups, see MachineGroup, and a
+  // group's transitions always run in order on a single thread. Everything
+  // the scheduler does still happens on the polling thread, in the same order
+  // as usual, so the results are the same as with 1 thread as long as no
+  // machine reads (or arms an edge on) a value that a machine in another group
+  // writes during the same tick. Writes are still seen by edges on the next
+  // tick like always, that's how groups are supposed to talk.
+  size_t threads = 1;
+};
+
+// A clock the simulator runs by itself instead of a machine waking up for
+// every edge, see SimBuilder::clock. Each edge flips *signal between 0 and 1
+// and then calls on_edge, which is where a verilated model gets eval()ed and
+// its traces dumped. Edges happen at the very end of their tick, so whatever
+// the machines wrote during that tick gets clocked in. Anything on_edge
+// changes is seen by edges at the start of the next tick, same as writes from
+// transitions.
+//
+// half_period and phase are in 1/divisor ticks, so clocks don't have to be
+// multiples of each other: 12 MHz against 10 MHz is half periods of 5 and 6
+// ticks, or of 1 and 1.2 with a divisor of 5. Edge n goes on tick
+// (phase + n * half_period) / divisor, rounded down, so the rounding never
+// adds up. A half period has to be at least a tick.
+//
+// Clocks with the same on_edge and ctx drive the same model. When several of
+// them have an edge on the same tick all of their signals flip first and
+// on_edge only gets called once.
+struct ClockSource {
+  uint8_t*    signal      = nullptr;
+  uint64_t    half_period = 1;
+  uint64_t    phase       = 0;
+  uint64_t    divisor     = 1;
+  void      (*on_edge)(void* ctx, uint64_t tick) = nullptr;
+  void*       ctx         = nullptr;
+  bool const* stop        = nullptr; // no more edges once this is true
+};
+
+// Machines added with the same group always run on the same thread, see
+// SimOptions::threads. Machines added without one get a group of their own
+struct MachineGroup {
+  uint32_t id;
+};
+
+// What happened during one of the Simulator::run_* calls
+struct RunStats {
+  uint64_t ticks  = 0; // how far time moved
+  uint64_t events = 0; // transitions taken
+};
+
 template <typename... MachineList>
 class Simulator {
 public:
-  // Returns true if there is more work to do
-  // ............ I think
+  // Runs a single tick (possibly after skipping idle ticks, see SimOptions).
+  // Returns true if there was anything left to do when the tick started.
   bool poll()
   {
-    if (outstanding_events.empty()) return false;
-
-    std::vector<E> next;
-    for (auto e : outstanding_events) { // copy everything
-      std::visit([&](auto m) {          // copy reference wrapper
-          std::visit([&](auto s) {      // copy state
-            bool last_completed = std::visit([this](auto&& ee) -> bool {
-                if (ee.canceled) return false;
-                return ee.satisfied(this->now_);
-            }, e.event);
-
-            if (last_completed) {
-              Events agg = std::visit([&](auto ee) -> Events {
-                return _invoke(m.get(), s, ee);
-              }, e.event); // queue only ever contains Simple Events
-
-              enqueue_many(next, m, agg);
-
-              // do ?something? to cancel whatever needs to be canceled
-              // don't ask me how this works
-              std::visit([&, this](auto&& ee) {
-                for (uint64_t cancel : ee.cancel_on_complete) {
-                auto body = [&](auto&& candidate) {
-                    auto mptr = [](auto&& m) { return (void*)&(m.get()); };
-                    void* cm = std::visit(mptr, candidate.machine);
-                    void* em = std::visit(mptr, e.machine);
-                    if (cm != em) return;
-
-                    uint64_t cid = std::visit([](auto&& eee) {
-                        return eee.event_id;
-                    }, candidate.event);
-
-                    if (cid != cancel) return;
-                    std::visit([](auto& eee) { eee.canceled = true; }, candidate.event);
-                  };
-
-                  for (auto& candidate : outstanding_events) body(candidate);
-                  for (auto& candidate : next) body(candidate);
-                }
-              }, e.event);
-            }
-            else {
-              bool canceled = std::visit([](auto&& ee) -> bool {
-                return ee.canceled;
-              }, e.event);
-              if (!canceled) next.push_back(e);
-            }
-          }, m.get().currentState());
-      }, e.machine);
-    }
-
-    now_ += 1; // perhaos the only sensible line of code in this file
-    outstanding_events = std::move(next); // why did I do this?
+    if (!busy()) return false;
+
+    auto start = poll_started();
+    if (idle()) skip_to(next_deadline(UINT64_MAX));
+    else        sample_signals();
+    tick();
+    polled(start);
     return true;
   }
 
+  // Runs the simulation forward by exactly `ticks` ticks, even if it runs out
+  // of things to do on the way. With time skipping this is cheap no matter how
+  // far apart the timers are.
+  RunStats run_for(uint64_t ticks) {
+    uint64_t start = now_, fired = fired_;
+    uint64_t end   = ticks > UINT64_MAX - now_ ? UINT64_MAX : now_ + ticks;
+
+    while (now_ < end) {
+      if (!busy()) { now_ = end; break; }
+
+      auto started = poll_started();
+      if (idle()) {
+        uint64_t next = next_deadline(end);
+        if (next >= end) { now_ = end; break; } // nothing left in the window
+        skip_to(next);
+      }
+      else {
+        sample_signals();
+      }
+      tick();
+      polled(started);
+    }
+
+    return RunStats{now_ - start, fired_ - fired};
+  }
+
+  // Polls until done() returns true (checked before every tick) or there's
+  // nothing left to do
+  template <typename Pred>
+  RunStats run_until(Pred&& done) {
+    uint64_t start = now_, fired = fired_;
+    while (!done() && poll()) { }
+    return RunStats{now_ - start, fired_ - fired};
+  }
+
+  // Polls until nothing can happen anymore, or max_ticks went by. Without time
+  // skipping only an empty simulator counts as done, edges might still come
+  // from the outside. A clock that hasn't been stopped always has something
+  // to do. With it, a bunch of watchers that nobody is going to poke
+  // is as good as nothing at all.
+  RunStats run_until_quiescent(uint64_t max_ticks = UINT64_MAX) {
+    uint64_t start = now_, fired = fired_;
+
+    while (busy() && now_ - start < max_ticks) {
+      auto started = poll_started();
+      if (idle()) {
+        uint64_t next = next_deadline(UINT64_MAX);
+        if (next == UINT64_MAX) break; // only watchers left
+        if (next - start >= max_ticks) { now_ = start + max_ticks; break; }
+        skip_to(next);
+      }
+      else {
+        sample_signals();
+      }
+      tick();
+      polled(started);
+    }
+
+    return RunStats{now_ - start, fired_ - fired};
+  }
+
+  uint64_t now() const { return now_; }
+
+  // For whoever drives this from the outside (see Federation.h).
+  //
+  // poke() after writing a watched value from outside, so the next poll
+  // looks at the signals even if time skipping thinks nothing can happen.
+  // settled() means nothing can happen before next_timer() unless poked.
+  void     poke()          { ran_ = true; }
+  bool     settled() const { return idle(); }
+  uint64_t next_timer()    { return next_deadline(UINT64_MAX); }
+
+  // Everything needed to come back to this exact point later: time, pending
+  // events, OneOf groups, ids and every machine (see has_checkpoint). Values
+  // that machines watch come back along with whoever owns them, anything
+  // else is up to the caller (and a poke() after putting it back). Only
+  // between polls, not from inside a transition.
+  //
+  // restore() can be called any number of times with the same checkpoint, so
+  // a long setup only has to be simulated once:
+  //
+  //   auto after_setup = sim.checkpoint();
+  //   for (auto& scenario : scenarios) {
+  //     sim.restore(after_setup);
+  //     ...
+  //   }
+  auto checkpoint() const {
+    if (in_tick_) throw std::logic_error("checkpoint() from inside a transition");
+
+    auto copy     = [](auto const&... x) { return std::make_tuple(x...); };
+    auto machines = std::apply([](auto const&... m) {
+      return std::make_tuple(checkpoint_machine(m.get())...);
+    }, machines_);
+
+    return std::make_pair(machines, std::apply(copy, state(*this)));
+  }
+
+  template <typename Checkpoint>
+  void restore(Checkpoint const& saved) {
+    if (in_tick_) throw std::logic_error("restore() from inside a transition");
+
+    restore_machines(saved.first, std::index_sequence_for<MachineList...>{});
+    state(*this) = saved.second;
+  }
+
+  // Every event that fires from now on goes to `to` (see Record.h), in the
+  // order the transitions run. nullptr stops recording. Costs a branch per
+  // event when off.
+  void record(Recorder* to) { recorder_ = to; }
+
+  // Runs the transitions from a recording again, in the same order and on
+  // the same ticks, without looking at a single timer or watched value.
+  // Whatever the transitions ask for next gets dropped, the recording already
+  // knows what happened. Meant for a simulator fresh out of get_sim() with
+  // machines set up the same way as the recorded ones, it's no good for
+  // anything else afterwards.
+  //
+  // Throws if a machine isn't in the state it was recorded in, i.e. the
+  // machines don't do the same thing they did back then.
+  RunStats replay(Playback& from) {
+    if (in_tick_) throw std::logic_error("replay() from inside a transition");
+
+    uint64_t   start = now_, fired = fired_;
+    FiredEvent f;
+    while (from.next(f)) {
+      if (f.machine >= sizeof...(MachineList) ||
+          f.kind >= std::variant_size_v<SimpleEvent>) {
+        throw std::runtime_error("recording doesn't fit this simulator");
+      }
+
+      now_ = f.tick;
+      if (state_of(f.machine) != f.state) {
+        std::ostringstream oss;
+        oss << "replay diverged at tick " << f.tick << ": machine " << f.machine
+            << " is in state " << state_of(f.machine) << " instead of " << f.state;
+        throw std::runtime_error(oss.str());
+      }
+
+      SimpleEvent ev = stand_in(f);
+      fired_ += 1;
+      dispatch(f.machine, ev);
+    }
+
+    return RunStats{now_ - start, fired_ - fired};
+  }
+
+  // Whatever got counted so far, see Stats.h. An empty NoStats without
+  // LIBSIM_STATS
+  auto const& stats() const { return stats_; }
+
+  // The same as JSON, with machines by index and states and events by name.
+  // Just {"enabled": false} without LIBSIM_STATS
+  void dump_stats(std::ostream& os) const {
+    if constexpr (!with_stats) {
+      os << "{\"enabled\": false}\n";
+    }
+    else {
+      auto names = state_names(std::index_sequence_for<MachineList...>{});
+
+      os << "{\"enabled\": true, \"ticks\": " << now_ << ", \"events\": " << fired_
+         << ", \"polls\": " << stats_.polls << ",\n \"transitions\": [";
+      char const* sep = "";
+      for (uint32_t m = 0; m < sizeof...(MachineList); ++m) {
+        for (uint32_t st = 0; st < names[m].size(); ++st) {
+          for (uint32_t k = 0; k < event_kinds; ++k) {
+            uint64_t n = stats_.transitions[transition_index(m, st, k)];
+            if (!n) continue;
+            os << sep << "\n  {\"machine\": " << m << ", \"state\": \"" << names[m][st]
+               << "\", \"event\": \"" << event_name(k) << "\", \"count\": " << n << "}";
+            sep = ",";
+          }
+        }
+      }
+
+      os << "],\n \"watchers\": {\"evaluations\": " << stats_.evaluations
+         << ", \"hits\": " << stats_.hits << "},\n \"cancellations\": "
+         << stats_.cancellations << ",\n \"queue_depth\": {\"max\": "
+         << stats_.max_depth << ", \"every\": " << stats_.depth_every << ", \"samples\": [";
+      sep = "";
+      for (auto [tick, depth] : stats_.depth) {
+        os << sep << "[" << tick << ", " << depth << "]";
+        sep = ", ";
+      }
+
+      // [at least this many ns, polls]
+      os << "]},\n \"poll_ns\": [";
+      sep = "";
+      for (size_t b = 0; b < SimStats::poll_buckets; ++b) {
+        if (!stats_.poll_ns[b]) continue;
+        os << sep << "[" << (b ? 1ull << b : 0) << ", " << stats_.poll_ns[b] << "]";
+        sep = ", ";
+      }
+      os << "]}\n";
+    }
+  }
+
 private:
+  // The scheduler's half of checkpoint() and restore(), in one place so
+  // neither of them can forget something. Scratch space and the thread pool
+  // stay put
+  template <typename Self>
+  static auto state(Self& s) {
+    return std::tie(s.now_, s.seq_, s.pending_, s.ran_, s.fired_, s.slots_,
+                    s.free_, s.heap_, s.wheel_, s.scan_, s.signals_,
+                    s.signal_ids_, s.bytes_, s.lane_ids_, s.wide_, s.dirty_,
+                    s.watch_links_, s.groups_, s.free_groups_, s.ids_,
+                    s.clocks_, s.next_clock_);
+  }
+
+  template <typename Saved, size_t... Is>
+  void restore_machines(Saved const& saved, std::index_sequence<Is...>) {
+    (restore_machine(std::get<Is>(machines_).get(), std::get<Is>(saved)), ...);
+  }
+
+  // Machines are known up front, so each one is just its position in
+  // machines_
   struct E {
-    std::variant<MachineList...> machine; // good luck
-    SimpleEvent                  event;
+    uint32_t    machine;
+    SimpleEvent event;
   };
 
-  uint64_t                            now_ = 0;
-  std::vector<E>                      outstanding_events; // should be priority queue
-  std::unordered_map<void*, uint64_t> ids_;               // literally insane
+  // The replayed version of a recorded event: right kind and ids, but
+  // nothing behind it to watch or wait for
+  static SimpleEvent stand_in(FiredEvent const& f) {
+    return stand_in(f, std::make_index_sequence<std::variant_size_v<SimpleEvent>>{});
+  }
 
-  template <typename Machine>
-  int add_init(std::reference_wrapper<Machine> m) {
-    std::visit([m, this](auto s){
-      Events agg = _invoke(m.get(), s, InitEvent{});
-      enqueue_many(this->outstanding_events, m, agg);
-    }, m.get().currentState());
-    return 0; // hack lol wtf
+  template <size_t... Ks>
+  static SimpleEvent stand_in(FiredEvent const& f, std::index_sequence<Ks...>) {
+    static constexpr uint8_t nothing = 0;
+
+    SimpleEvent ev = InitEvent{};
+    auto make = [&](auto k) {
+      using T = std::variant_alternative_t<decltype(k)::value, SimpleEvent>;
+      if constexpr (std::is_same_v<T, Equals>)         ev = T{&nothing, 0, f.user_id};
+      else if constexpr (std::is_same_v<T, MaskMatch>) ev = T{&nothing, 0, 0, f.user_id};
+      else if constexpr (is_watcher<T>)                ev = T{&nothing, f.user_id};
+      else if constexpr (std::is_same_v<T, Timeout>)   ev = T{0, f.user_id};
+      else                                             ev = T{f.user_id};
+    };
+    ((f.kind == Ks ? make(std::integral_constant<size_t, Ks>{}) : void()), ...);
+
+    std::visit([&](auto& e) { e.set_id(f.event_id); }, ev);
+    return ev;
   }
 
-  template <typename Machine>
-  void enqueue_many(std::vector<E>& next, Machine m, Events e) {
+  // groups has a tag per machine, -1 for "on its own"
+  Simulator(std::tuple<MachineList...> machines, SimOptions opts,
+            std::array<int64_t, sizeof...(MachineList)> const& groups,
+            std::vector<ClockSource> const& clocks)
+    : machines_(machines)
+    , opts_(opts)
+  {
+    for (ClockSource const& c : clocks) {
+      if (c.divisor == 0)              throw std::logic_error("clock with a divisor of 0");
+      if (c.half_period < c.divisor)   throw std::logic_error("clock with a half period under a tick");
+
+      // the first clock of its model does the model's on_edge calls
+      uint32_t eval = clocks_.size();
+      for (uint32_t i = 0; i < clocks_.size(); ++i) {
+        if (c.on_edge && c.on_edge == clocks_[i].src.on_edge && c.ctx == clocks_[i].src.ctx) {
+          eval = i;
+          break;
+        }
+      }
+
+      clocks_.push_back(Clock{c, c.phase, c.phase / c.divisor, eval, false, false});
+      next_clock_ = std::min(next_clock_, clocks_.back().next);
+    }
+
+    if constexpr (with_stats) {
+      stats_.transitions.assign(transition_base[sizeof...(MachineList)], 0);
+    }
+
+    if (opts_.threads <= 1) return;
+
+    std::unordered_map<int64_t, uint32_t> dense;
+    for (size_t i = 0; i < groups.size(); ++i) {
+      if (groups[i] < 0) machine_group_[i] = machine_groups_++;
+      else {
+        auto it = dense.emplace(groups[i], machine_groups_).first;
+        if (it->second == machine_groups_) machine_groups_ += 1;
+        machine_group_[i] = it->second;
+      }
+    }
+
+    pool_ = std::make_unique<WorkerPool>(opts_.threads);
+  }
+
+  // Every pending event lives in a slot. Timers are additionally referenced
+  // from a timer queue keyed on deadline, everything else is an edge watcher
+  // hanging off of the Signal it watches.
+  // Slots get reused, so references carry the seq of the event they were
+  // created for and go stale once the slot is released.
+  struct Pending {
+    E        e;
+    uint64_t seq;
+    uint32_t group; // OneOf this came from, or nil
+    bool     live;
+  };
+
+  using Ref = SlotRef;
+
+  static constexpr bool with_stats = stats_for<MachineList...>;
+
+  using Stats = std::conditional_t<with_stats, SimStats, NoStats>;
+
+  struct Clock {
+    ClockSource src;
+    uint64_t    at;   // next edge, in 1/divisor ticks
+    uint64_t    next; // and its tick
+    uint32_t    eval; // clock that calls on_edge for this one
+    bool        stopped;
+    bool        due;  // some clock of the same model had an edge this tick
+  };
+
+  static constexpr uint32_t nil = UINT32_MAX;
+
+  // Everything that came out of a single OneOf. The first member to fire
+  // cancels the rest, which only costs the size of the group no matter how
+  // much else is pending. Groups (and their member lists) get reused.
+  struct Group {
+    SmallVec<Ref, inline_events> members;
+  };
+
+  // A value that edge events are watching. Its watchers are only evaluated
+  // when the value is different from the last time we looked (or when a new
+  // watcher shows up, since it may have a different idea of "last").
+  // Single bytes get packed into bytes_ so they can be compared in bulk,
+  // everything else is on its own.
+  struct Signal {
+    void const* ptr;
+    size_t      width;    // bytes, 0 if we don't know how to compare it
+    uint64_t    snapshot;
+    uint32_t    lane;     // in bytes_, or nil
+    bool        dirty;    // in dirty_?
+    uint32_t    head;     // watcher slots, oldest first
+    uint32_t    tail;
+  };
+
+  // Per slot links for the watcher lists
+  struct WatchLink {
+    uint32_t signal;
+    uint32_t prev;
+    uint32_t next;
+    bool     linked;
+  };
+
+  std::tuple<MachineList...>                   machines_; // reference_wrappers
+  SimOptions                                   opts_;
+  uint64_t                                     now_     = 0;
+  uint64_t                                     seq_     = 0;
+  size_t                                       pending_ = 0; // live slots
+  bool                                         in_tick_ = false;
+  bool                                         ran_     = true; // any transitions last tick?
+  uint64_t                                     fired_   = 0;    // transitions taken so far
+  Recorder*                                    recorder_ = nullptr; // see record()
+  std::vector<Clock>                           clocks_;
+  uint64_t                                     next_clock_ = UINT64_MAX; // of any clock
+  Stats                                        stats_;
+  std::vector<Pending>                         slots_;
+  std::vector<uint32_t>                        free_;
+  TimerHeap                                    heap_;        // one of these three is used
+  TimerWheel                                   wheel_;
+  TimerScan                                    scan_;
+  std::vector<Signal>                          signals_;
+  std::unordered_map<void const*, uint32_t>    signal_ids_;
+  ByteSnapshot                                 bytes_;       // 1 byte signals
+  std::vector<uint32_t>                        lane_ids_;    // lane -> signal
+  std::vector<uint32_t>                        wide_;        // the other signals
+  std::vector<uint32_t>                        dirty_;       // new watchers
+  std::vector<WatchLink>                       watch_links_; // by slot
+  std::vector<Group>                           groups_;
+  std::vector<uint32_t>                        free_groups_;
+  std::vector<Ref>                             due_;         // scratch
+  std::vector<Ref>                             hits_;        // scratch
+  std::array<uint64_t, sizeof...(MachineList)> ids_{}; // last id per machine
+
+  // only used with more than one thread
+  struct Fired {
+    E                  e;
+    uint32_t           state; // before the transition, for log_fired
+    Events             result;
+    std::exception_ptr error;
+  };
+
+  std::unique_ptr<WorkerPool>                  pool_;
+  std::array<uint32_t, sizeof...(MachineList)> machine_group_{};
+  uint32_t                                     machine_groups_ = 0;
+  std::vector<Fired>                           batch_;       // this tick, in seq order
+  std::vector<uint32_t>                        group_start_; // into order_, by group
+  std::vector<uint32_t>                        group_fill_;  // scratch
+  std::vector<uint32_t>                        order_;       // batch_ by group
+  std::vector<uint32_t>                        busy_groups_;
+
+  bool is_live(Ref r) const {
+    Pending const& p = slots_[r.slot];
+    return p.live && p.seq == r.seq;
+  }
+
+  // Finds every watcher that fires this tick. Leaves them in hits_, in seq
+  // order
+  void sample_signals() {
+    hits_.clear();
+
+    // new watchers get a look no matter what. Anything we can't compare gets
+    // one below anyway
+    for (uint32_t id : dirty_) {
+      Signal& sig = signals_[id];
+      sig.dirty   = false;
+      if (!sig.width) continue;
+
+      if (sig.lane != nil) bytes_.refresh(sig.lane);
+      sig.snapshot = load_value(sig.ptr, sig.width);
+      evaluate(sig);
+    }
+    dirty_.clear();
+
+    // single bytes (most verilated ports) are diffed all at once, so only the
+    // ones that changed cost anything
+    size_t changed = bytes_.sample();
+    for (size_t k = 0; k < changed; ++k) {
+      uint32_t lane = bytes_.changed(k);
+      Signal&  sig  = signals_[lane_ids_[lane]];
+      if (sig.width != 1) continue; // got demoted, it's in wide_ now
+
+      sig.snapshot = bytes_.value(lane);
+      evaluate(sig);
+    }
+
+    // everything else one at a time
+    for (uint32_t id : wide_) {
+      Signal& sig = signals_[id];
+      if (sig.head == nil) continue; // nobody cares
+
+      uint64_t v = load_value(sig.ptr, sig.width);
+      if (sig.width && v == sig.snapshot) continue;
+      sig.snapshot = v;
+      evaluate(sig);
+    }
+
+    // each signal's watchers are in order, but the signals aren't
+    if (hits_.size() > 1) {
+      std::sort(hits_.begin(), hits_.end(), [](Ref a, Ref b) {
+        return a.seq < b.seq;
+      });
+    }
+  }
+
+  // Runs the signal's watchers against its snapshot. A signal watched as two
+  // different widths doesn't have one, those watchers read it themselves
+  void evaluate(Signal const& sig) {
+    uint64_t v     = sig.snapshot;
+    size_t   width = sig.width;
+
+    for (uint32_t w = sig.head; w != nil; w = watch_links_[w].next) {
+      bool hit = std::visit([v, width](auto& ee) -> bool {
+        using T = std::decay_t<decltype(ee)>;
+        if constexpr (is_watcher<T>) {
+          return ee.fires(ee.width == width ? v : load_value(ee.ptr, ee.width));
+        }
+        else {
+          return false;
+        }
+      }, slots_[w].e.event);
+
+      if (hit) hits_.push_back(Ref{slots_[w].seq, w});
+
+      if constexpr (with_stats) {
+        stats_.evaluations += 1;
+        stats_.hits        += hit;
+      }
+    }
+  }
+
+  void watch(Ref r, void const* ptr, size_t width) {
+    // punt on anything we can't compare, look at it every tick
+    if (width != 1 && width != 2 && width != 4 && width != 8) width = 0;
+
+    // find first, emplace allocates a node even if the key is already there
+    auto it = signal_ids_.find(ptr);
+    if (it == signal_ids_.end()) {
+      uint32_t id   = signals_.size();
+      uint32_t lane = nil;
+
+      if (width == 1) {
+        lane = bytes_.add(static_cast<uint8_t const*>(ptr));
+        lane_ids_.push_back(id);
+      }
+      else {
+        wide_.push_back(id);
+      }
+
+      it = signal_ids_.emplace(ptr, id).first;
+      signals_.push_back(Signal{ptr, width, 0, lane, false, nil, nil});
+    }
+
+    Signal& sig = signals_[it->second];
+    if (sig.width != width) {
+      // watched as two different things, give up on comparing it. Keeps its
+      // lane but that gets ignored from now on
+      if (sig.width == 1) wide_.push_back(it->second);
+      sig.width = 0;
+    }
+
+    if (!sig.dirty) {
+      sig.dirty = true;
+      dirty_.push_back(it->second);
+    }
+
+    if (r.slot >= watch_links_.size()) watch_links_.resize(r.slot + 1);
+    watch_links_[r.slot] = WatchLink{it->second, sig.tail, nil, true};
+
+    if (sig.tail != nil) watch_links_[sig.tail].next = r.slot;
+    else                 sig.head = r.slot;
+    sig.tail = r.slot;
+  }
+
+  void unwatch(uint32_t slot) {
+    WatchLink& l   = watch_links_[slot];
+    Signal&    sig = signals_[l.signal];
+
+    if (l.prev != nil) watch_links_[l.prev].next = l.next;
+    else               sig.head = l.next;
+    if (l.next != nil) watch_links_[l.next].prev = l.prev;
+    else               sig.tail = l.prev;
+
+    l.linked = false;
+  }
+
+  // Watched values can change between polls, so they get looked at at the
+  // start of every tick. When skipping we've been promised that only machines
+  // write them, so if nothing ran last tick there's nothing new to see and
+  // nothing can happen before the next timer fires (see SimOptions).
+  bool idle() const { return opts_.time_skipping && !ran_; }
+
+  // anything left that could ever happen
+  bool busy() const { return pending_ != 0 || next_clock_ != UINT64_MAX; }
+
+  // Earliest live timer deadline, or `otherwise` if there are no timers
+  uint64_t next_deadline(uint64_t otherwise) {
+    uint64_t deadline;
+    bool     any;
+    switch (opts_.timers) {
+      case TimerBackend::Wheel: any = wheel_.next_deadline(deadline); break;
+      case TimerBackend::Scan:  any = scan_.next_deadline(deadline);  break;
+      default:
+        any = heap_.next_deadline(deadline, [this](Ref r) { return is_live(r); });
+    }
+
+    // clocks count as timers here
+    return std::min(any ? deadline : otherwise, next_clock_);
+  }
+
+  // Jumps over idle ticks. Nobody was sampled, so no edges either
+  void skip_to(uint64_t tick) {
+    if (tick != UINT64_MAX) now_ = std::max(now_, tick);
+    hits_.clear();
+  }
+
+  // Runs the current tick once the watchers have been sampled (or skipped)
+  void tick() {
+    ran_ = false;
+    if constexpr (with_stats) stats_.sample_depth(now_, pending_);
+
+    // Grab everything that is due before running any transitions. Anything
+    // enqueued by this tick's transitions has to wait for the next tick.
+    due_.clear();
+    switch (opts_.timers) {
+      case TimerBackend::Wheel: wheel_.pop_due(now_, due_); break;
+      case TimerBackend::Scan:  scan_.pop_due(now_, due_);  break;
+      default:
+        heap_.pop_due(now_, due_, [this](Ref r) { return is_live(r); });
+    }
+
+    in_tick_ = true;
+
+    if (pool_) {
+      fire_parallel();
+    }
+    else {
+      for_each_due([this](uint32_t slot) {
+        E e = take(slot);
+        if (recorder_ || with_stats) log_fired(e, state_of(e.machine));
+        enqueue_many(e.machine, dispatch(e.machine, e.event));
+      });
+    }
+
+    in_tick_ = false;
+    if (now_ >= next_clock_) run_clocks();
+    now_ += 1;
+  }
+
+  // Every clock with an edge on this tick, in the order they were added.
+  // Signals first, then one on_edge per model
+  void run_clocks() {
+    next_clock_ = UINT64_MAX;
+
+    for (Clock& c : clocks_) {
+      if (c.stopped) continue;
+
+      if (c.next == now_) {
+        if (c.src.stop && *c.src.stop) {
+          c.stopped = true;
+          continue;
+        }
+
+        if (c.src.signal) *c.src.signal ^= 1;
+        clocks_[c.eval].due = true;
+        c.at  += c.src.half_period;
+        c.next = c.at / c.src.divisor;
+        ran_   = true; // somebody might be watching
+      }
+
+      next_clock_ = std::min(next_clock_, c.next);
+    }
+
+    for (Clock& c : clocks_) {
+      if (!c.due) continue;
+      c.due = false;
+      if (c.src.on_edge) c.src.on_edge(c.src.ctx, now_);
+    }
+  }
+
+  // Both lists are in seq order, walk them together so events are still
+  // handled in the order they were enqueued. Anything in either list might
+  // get canceled by something that fires before it
+  template <typename F>
+  void for_each_due(F&& f) {
+    size_t ti = 0, hi = 0;
+    while (ti < due_.size() || hi < hits_.size()) {
+      bool timer_first = hi == hits_.size()
+        || (ti < due_.size() && due_[ti].seq < hits_[hi].seq);
+
+      Ref r = timer_first ? due_[ti++] : hits_[hi++];
+      if (is_live(r)) f(r.slot);
+    }
+  }
+
+  // Nothing a transition does can cancel or fire anything else this tick, so
+  // which events fire (and which siblings they take down with them) is known
+  // before any transitions run. That part and queueing up whatever the
+  // transitions returned happen here, in seq order, exactly like the serial
+  // loop. Only the transitions themselves go to the pool, a job per group.
+  void fire_parallel() {
+    batch_.clear();
+    for_each_due([this](uint32_t slot) {
+      batch_.push_back(Fired{take(slot), 0, None{}, nullptr});
+    });
+    if (batch_.empty()) return;
+
+    // counting sort by group, seq order within a group stays the same
+    group_start_.assign(machine_groups_ + 1, 0);
+    for (Fired const& f : batch_) group_start_[machine_group_[f.e.machine] + 1] += 1;
+    for (uint32_t g = 0; g < machine_groups_; ++g) group_start_[g + 1] += group_start_[g];
+
+    group_fill_.assign(group_start_.begin(), group_start_.end() - 1);
+    order_.resize(batch_.size());
+    for (uint32_t i = 0; i < batch_.size(); ++i) {
+      order_[group_fill_[machine_group_[batch_[i].e.machine]]++] = i;
+    }
+
+    busy_groups_.clear();
+    for (uint32_t g = 0; g < machine_groups_; ++g) {
+      if (group_start_[g] != group_start_[g + 1]) busy_groups_.push_back(g);
+    }
+
+    auto job = [this](size_t k) {
+      uint32_t g = busy_groups_[k];
+      for (uint32_t p = group_start_[g]; p < group_start_[g + 1]; ++p) {
+        Fired& f = batch_[order_[p]];
+        try {
+          f.state  = state_of(f.e.machine);
+          f.result = dispatch(f.e.machine, f.e.event);
+        }
+        catch (...) {
+          f.error = std::current_exception();
+          return; // the rest of the group never happened
+        }
+      }
+    };
+    pool_->run(busy_groups_.size(), job);
+
+    for (Fired& f : batch_) {
+      if (f.error) std::rethrow_exception(f.error);
+      if (recorder_ || with_stats) log_fired(f.e, f.state);
+      enqueue_many(f.e.machine, std::move(f.result));
+    }
+  }
+
+  // first tick a newly enqueued event is allowed to fire on
+  uint64_t earliest() const { return now_ + (in_tick_ ? 1 : 0); }
+
+  uint32_t acquire(E&& e, uint64_t seq, uint32_t group) {
+    pending_ += 1;
+    if (free_.empty()) {
+      slots_.push_back(Pending{std::move(e), seq, group, true});
+      return (uint32_t)(slots_.size() - 1);
+    }
+
+    uint32_t slot = free_.back();
+    free_.pop_back();
+    slots_[slot] = Pending{std::move(e), seq, group, true};
+    return slot;
+  }
+
+  uint32_t new_group() {
+    if (free_groups_.empty()) {
+      groups_.emplace_back();
+      return (uint32_t)(groups_.size() - 1);
+    }
+
+    uint32_t g = free_groups_.back();
+    free_groups_.pop_back();
+    return g;
+  }
+
+  // Someone in the group fired, everyone else is canceled. Heap timers stay
+  // where they are until they come up and turn out to be dead
+  void resolve(uint32_t g) {
+    for (Ref r : groups_[g].members) {
+      if (!is_live(r)) continue;
+      release(r.slot);
+      if constexpr (with_stats) stats_.cancellations += 1;
+    }
+
+    groups_[g].members.clear();
+    free_groups_.push_back(g);
+  }
+
+  void release(uint32_t slot) {
+    // the heap drops dead timers lazily, the others can just forget them
+    if (opts_.timers == TimerBackend::Wheel) {
+      wheel_.remove(Ref{slots_[slot].seq, slot});
+    }
+    else if (opts_.timers == TimerBackend::Scan) {
+      scan_.remove(Ref{slots_[slot].seq, slot});
+    }
+
+    if (slot < watch_links_.size() && watch_links_[slot].linked) unwatch(slot);
+
+    slots_[slot].live = false;
+    free_.push_back(slot);
+    pending_ -= 1;
+  }
+
+  // Takes a live event out of its slot to fire it, along with any OneOf
+  // siblings
+  E take(uint32_t slot) {
+    uint32_t group = slots_[slot].group;
+    E        e     = std::move(slots_[slot].e);
+    release(slot);
+    if (group != nil) resolve(group);
+    ran_ = true;
+    fired_ += 1;
+    return e;
+  }
+
+  // One entry per machine, so finding the machine is an array lookup instead
+  // of a visit over every machine type
+  using Dispatcher = Events (Simulator::*)(SimpleEvent&);
+
+  template <size_t... Is>
+  static constexpr std::array<Dispatcher, sizeof...(Is)>
+  make_dispatchers(std::index_sequence<Is...>) {
+    return {&Simulator::dispatch_to<Is>...};
+  }
+
+  // Only runs the transition, doesn't touch the scheduler at all
+  Events dispatch(uint32_t machine, SimpleEvent& ev) {
+    static constexpr auto dispatchers =
+      make_dispatchers(std::index_sequence_for<MachineList...>{});
+    return (this->*dispatchers[machine])(ev);
+  }
+
+  // currentState() can hand back a reference or a copy, we only need to look
+  template <size_t I>
+  Events dispatch_to(SimpleEvent& ev) {
+    auto& m = std::get<I>(machines_).get();
+    using M = std::decay_t<decltype(m)>;
+
+    if constexpr (has_resume<M>::value) {
+      return m.resume(ev);
+    }
+    else {
+      auto const& s = m.currentState();
+      return Transitions<M>::dispatch(m, s, ev);
+    }
+  }
+
+  // Index of the machine's current state, same deal as dispatch()
+  using StateOf = uint32_t (Simulator::*)() const;
+
+  template <size_t... Is>
+  static constexpr std::array<StateOf, sizeof...(Is)>
+  make_state_ofs(std::index_sequence<Is...>) {
+    return {&Simulator::state_of<Is>...};
+  }
+
+  uint32_t state_of(uint32_t machine) const {
+    static constexpr auto state_ofs =
+      make_state_ofs(std::index_sequence_for<MachineList...>{});
+    return (this->*state_ofs[machine])();
+  }
+
+  template <size_t I>
+  uint32_t state_of() const {
+    return (uint32_t)std::get<I>(machines_).get().currentState().index();
+  }
+
+  static_assert(std::variant_size_v<SimpleEvent> <= 1u << record::kind_bits,
+                "event kinds don't fit in a recording anymore");
+
+  // For the recorder and the stats, right before the transition runs
+  void log_fired(E const& e, uint32_t state) {
+    uint32_t kind = (uint32_t)e.event.index();
+
+    if (recorder_) {
+      auto& ev = std::visit([](auto& ev) -> EventBase const& { return ev; }, e.event);
+      recorder_->add(FiredEvent{now_, e.machine, state, kind, ev.user_id, ev.event_id});
+    }
+
+    if constexpr (with_stats) {
+      stats_.transitions[transition_index(e.machine, state, kind)] += 1;
+    }
+  }
+
+  // SimStats::transitions has a (state, event kind) grid per machine, one
+  // after the other
+  static constexpr size_t event_kinds = std::variant_size_v<SimpleEvent>;
+
+  template <typename R>
+  using StatesOf = std::decay_t<decltype(std::declval<typename R::type&>().currentState())>;
+
+  static constexpr auto transition_base = [] {
+    std::array<size_t, sizeof...(MachineList) + 1> base{};
+    size_t states[] = {std::variant_size_v<StatesOf<MachineList>>..., 0};
+    for (size_t i = 0; i < sizeof...(MachineList); ++i) {
+      base[i + 1] = base[i] + states[i] * event_kinds;
+    }
+    return base;
+  }();
+
+  static size_t transition_index(uint32_t machine, uint32_t state, uint32_t kind) {
+    return transition_base[machine] + state * event_kinds + kind;
+  }
+
+  template <size_t... Is>
+  static auto state_names(std::index_sequence<Is...>) {
+    return std::array<std::vector<char const*>, sizeof...(Is)>{
+      names_of<StatesOf<std::tuple_element_t<Is, std::tuple<MachineList...>>>>(
+        std::make_index_sequence<std::variant_size_v<
+          StatesOf<std::tuple_element_t<Is, std::tuple<MachineList...>>>>>{})...
+    };
+  }
+
+  template <typename V, size_t... Ss>
+  static std::vector<char const*> names_of(std::index_sequence<Ss...>) {
+    return {std::variant_alternative_t<Ss, V>{}.human_readable...};
+  }
+
+  static char const* event_name(uint32_t kind) {
+    return std::visit([](auto const& e) { return e.human_readable; },
+                      stand_in(FiredEvent{0, 0, 0, kind, 0, 0}));
+  }
+
+  // Clock reading for SimStats::poll_ns, or nothing at all
+  static auto poll_started() {
+    if constexpr (with_stats) return SimStats::Clock::now();
+    else                         return 0;
+  }
+
+  template <typename Start>
+  void polled([[maybe_unused]] Start start) {
+    if constexpr (with_stats) stats_.polled(start);
+  }
+
+  template <size_t... Is>
+  void init_all(std::index_sequence<Is...>) {
+    (init<Is>(), ...);
+  }
+
+  template <size_t I>
+  void init() {
+    SimpleEvent ev = InitEvent{};
+    enqueue_many(I, dispatch_to<I>(ev));
+  }
+
+  void enqueue_many(uint32_t m, Events&& e) {
     // FIXME rewrite as callable struct w/ overloads to get rid of runtime
     // exception
-    std::visit([&](auto&& ee) {
+    std::visit([&](auto& ee) {
       using T = std::decay_t<decltype(ee)>;
       if constexpr (std::is_same_v<T, None>) {
         // nothing to do!
       }
       else if constexpr (std::is_same_v<T, Only>) {
-        enqueue_new(next, m, ee.ev);
+        enqueue_new(m, std::move(ee.ev));
       }
       else if constexpr (std::is_same_v<T, AllOf>) {
-        for (auto&& eee : ee.events) enqueue_new(next, m, eee);
+        for (auto& eee : ee.events) enqueue_new(m, std::move(eee));
       }
       else if constexpr (std::is_same_v<T, OneOf>) {
-        std::vector<uint64_t> cancel_ids;
-        for (auto&& eee : ee.events) {
-          cancel_ids.push_back(assign_id(m, eee));
-        }
-
-        for (auto&& eee : ee.events) {
-          set_cancel_ids(eee, cancel_ids);
-          enqueue_new(next, m, eee);
+        uint32_t g = new_group();
+        for (auto& eee : ee.events) {
+          groups_[g].members.push_back(enqueue_new(m, std::move(eee), g));
         }
       }
       else {
@@ -375,80 +1529,151 @@ private:
     }, e);
   }
 
-  template <typename Machine>
-  void enqueue_new(std::vector<E>& next, Machine m, SimpleEvent e) {
+  Ref enqueue_new(uint32_t m, SimpleEvent&& e, uint32_t group = nil) {
     assign_id(m, e); // too many code paths
 
-    return std::visit([&, this](auto&& ee) {
+    uint64_t    seq      = ++seq_;
+    uint64_t    deadline = earliest();
+    void const* watched  = nullptr;
+    size_t      width    = 0;
+    std::visit([&, this](auto&& ee) {
       using T = std::decay_t<decltype(ee)>;
       if constexpr (std::is_same_v<T, Timeout>) {
         ee.start(this->now_);
+        deadline = std::max(deadline, ee.start_time + ee.duration);
+      }
+      else if constexpr (std::is_same_v<T, InitEvent>) {
+        // always satisfied, same as a zero length timeout
+      }
+      else {
+        watched = ee.ptr;
+        width   = ee.width;
       }
-
-      next.push_back( E{m, ee} );
     }, e);
+
+    uint32_t slot = acquire(E{m, std::move(e)}, seq, group);
+    Ref      r{seq, slot};
+
+    // New watchers get their first look when signals are sampled at the
+    // start of next tick
+    if (watched) {
+      watch(r, watched, width);
+    }
+    else if (opts_.timers == TimerBackend::Wheel) {
+      wheel_.add(TimerRef{deadline, r});
+    }
+    else if (opts_.timers == TimerBackend::Scan) {
+      scan_.add(TimerRef{deadline, r});
+    }
+    else {
+      heap_.add(TimerRef{deadline, r});
+    }
+
+    return r;
   }
 
   // modifies the event because I haven't used this feature of c++ yet
-  template <typename Machine>
-  uint64_t assign_id(Machine m, SimpleEvent& e) {
+  uint64_t assign_id(uint32_t m, SimpleEvent& e) {
     return std::visit([&, this](auto&& ee) {
-      if (!ee.has_id()) ee.set_id(next_id_for(m));
+      if (!ee.has_id()) ee.set_id(++ids_[m]); // zero isn't a valid id
       return ee.event_id;
     }, e);
   }
 
-  void set_cancel_ids(SimpleEvent& e, std::vector<uint64_t> const& cancel_ids) {
-    // exclude yourself because the user of this function probably couldn't be
-    // bothered to? Rewrite the user? No!
-    std::visit([&](auto&& ee) {
-      for (uint64_t c : cancel_ids) {
-        if (c != ee.event_id) ee.cancel_on_complete.push_back(c);
-      }
-    }, e);
-  }
-
-  // We are storing references to machines, so we know they can't be moving
-  // around. Use pointers. It's safe I promise
-  template <typename Machine>
-  uint64_t next_id_for(std::reference_wrapper<Machine> m) {
-    void* ptr = &(m.get());
-    ids_[ptr] += 1; // zero isn't a valid id, always increment
-    return ids_[ptr];
-  }
-
   friend class SimBuilder<MachineList...>;
 };
 
 // big hack to hide the types from the user
 template <typename... MachineList>
 class SimBuilder {
+  using Groups = std::array<int64_t, sizeof...(MachineList)>;
+
 public:
   SimBuilder() {}
 
-  SimBuilder(std::tuple<MachineList...> machines) : machines_(machines) {}
+  SimBuilder(std::tuple<MachineList...> machines, SimOptions opts,
+             Groups groups = ungrouped(), std::vector<ClockSource> clocks = {})
+    : machines_(machines)
+    , opts_(opts)
+    , groups_(groups)
+    , clocks_(std::move(clocks))
+  {}
 
   template <typename Machine>
   SimBuilder<std::reference_wrapper<Machine>, MachineList...> add(Machine& m) &&
   {
-    return {std::tuple_cat(std::make_tuple(std::reference_wrapper(m)),
-                           std::move(machines_))};
+    return std::move(*this).add(m, -1);
   }
 
-  Simulator<MachineList...> get_sim() const {
-    Simulator<MachineList...> ret;
+  // See MachineGroup
+  template <typename Machine>
+  SimBuilder<std::reference_wrapper<Machine>, MachineList...> add(Machine& m, MachineGroup g) &&
+  {
+    return std::move(*this).add(m, (int64_t)g.id);
+  }
 
-    // sort of a hack for iterator
-    std::apply([&ret](auto... ms) {
-      auto blah = {ret.add_init(ms)...};
-      (void)blah;
-    }, machines_);
+  // See TimerBackend
+  SimBuilder timers(TimerBackend backend) &&
+  {
+    opts_.timers = backend;
+    return std::move(*this);
+  }
+
+  // See SimOptions::time_skipping
+  SimBuilder time_skipping(bool enable = true) &&
+  {
+    opts_.time_skipping = enable;
+    return std::move(*this);
+  }
+
+  // See SimOptions::threads
+  SimBuilder threads(size_t n) &&
+  {
+    opts_.threads = n;
+    return std::move(*this);
+  }
+
+  // See ClockSource. Clocks with edges on the same tick go in the order they
+  // were added, and so do their models' on_edge calls
+  SimBuilder clock(ClockSource c) &&
+  {
+    clocks_.push_back(c);
+    return std::move(*this);
+  }
 
+  Simulator<MachineList...> get_sim() const {
+    Simulator<MachineList...> ret(machines_, opts_, groups_, clocks_);
+    ret.init_all(std::index_sequence_for<MachineList...>{});
     return ret;
   }
 
 private:
+  template <typename... Ms>
+  friend class SimBuilder;
+
+  static Groups ungrouped() {
+    Groups g;
+    g.fill(-1);
+    return g;
+  }
+
+  // new machines go in front, see the tuple_cat
+  template <typename Machine>
+  SimBuilder<std::reference_wrapper<Machine>, MachineList...> add(Machine& m, int64_t group) &&
+  {
+    std::array<int64_t, sizeof...(MachineList) + 1> groups;
+    groups[0] = group;
+    std::copy(groups_.begin(), groups_.end(), groups.begin() + 1);
+
+    return {std::tuple_cat(std::make_tuple(std::reference_wrapper(m)),
+                           std::move(machines_)),
+            opts_, groups, std::move(clocks_)};
+  }
+
   std::tuple<MachineList...> machines_;
+  SimOptions                 opts_;
+  Groups                     groups_ = ungrouped();
+  std::vector<ClockSource>   clocks_;
 };
 
 }; // namespace libsim. thank god its over
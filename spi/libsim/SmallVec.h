@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Just enough of std::vector to hold event lists. The first N elements live
+// inside the object, so the usual "wait for this or that" never goes near
+// malloc. Anything bigger spills to the heap like a normal vector.
+
+namespace libsim {
+
+template <typename T, size_t N>
+class SmallVec {
+  static_assert(N > 0, "that's just a vector");
+
+public:
+  SmallVec() = default;
+
+  SmallVec(SmallVec const& other) {
+    reserve(other.size_);
+    for (T const& t : other) push_back(t);
+  }
+
+  SmallVec(SmallVec&& other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+    steal(std::move(other));
+  }
+
+  SmallVec& operator=(SmallVec const& other) {
+    if (this != &other) {
+      clear();
+      reserve(other.size_);
+      for (T const& t : other) push_back(t);
+    }
+    return *this;
+  }
+
+  SmallVec& operator=(SmallVec&& other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+    if (this != &other) {
+      clear();
+      free_heap();
+      steal(std::move(other));
+    }
+    return *this;
+  }
+
+  ~SmallVec() {
+    clear();
+    free_heap();
+  }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (size_ == cap_) grow(cap_ * 2);
+    T* t = new (data_ + size_) T(std::forward<Args>(args)...);
+    size_ += 1;
+    return *t;
+  }
+
+  void push_back(T const& t) { emplace_back(t); }
+  void push_back(T&& t)      { emplace_back(std::move(t)); }
+
+  void reserve(size_t n) { if (n > cap_) grow(n); }
+
+  void clear() {
+    for (size_t i = 0; i < size_; ++i) data_[i].~T();
+    size_ = 0;
+  }
+
+  size_t size()     const { return size_; }
+  size_t capacity() const { return cap_; }
+  bool   empty()    const { return size_ == 0; }
+  bool   spilled()  const { return data_ != local(); } // on the heap?
+
+  T&       operator[](size_t i)       { return data_[i]; }
+  T const& operator[](size_t i) const { return data_[i]; }
+
+  T*       begin()       { return data_; }
+  T*       end()         { return data_ + size_; }
+  T const* begin() const { return data_; }
+  T const* end()   const { return data_ + size_; }
+
+private:
+  T*       local()       { return reinterpret_cast<T*>(&inline_); }
+  T const* local() const { return reinterpret_cast<T const*>(&inline_); }
+
+  void grow(size_t cap) {
+    T* bigger = static_cast<T*>(::operator new(cap * sizeof(T)));
+    for (size_t i = 0; i < size_; ++i) {
+      new (bigger + i) T(std::move(data_[i]));
+      data_[i].~T();
+    }
+    free_heap();
+    data_ = bigger;
+    cap_  = cap;
+  }
+
+  void free_heap() {
+    if (spilled()) ::operator delete(data_);
+    data_ = local();
+    cap_  = N;
+  }
+
+  // expects this to be empty and not spilled
+  void steal(SmallVec&& other) {
+    if (other.spilled()) {
+      data_ = other.data_;
+      size_ = other.size_;
+      cap_  = other.cap_;
+      other.data_ = other.local();
+      other.size_ = 0;
+      other.cap_  = N;
+      return;
+    }
+
+    for (T& t : other) emplace_back(std::move(t));
+    other.clear();
+  }
+
+  std::aligned_storage_t<sizeof(T) * N, alignof(T)> inline_;
+  T*                                                data_ = local();
+  size_t                                            size_ = 0;
+  size_t                                            cap_  = N;
+};
+
+} // namespace libsim
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Counters for finding out where a simulation spends its time, see
+// Simulator::stats and Simulator::dump_stats. Only there when LIBSIM_STATS is
+// defined, otherwise the simulator keeps an empty NoStats and every place
+// that would count something is an `if constexpr` that's gone at compile
+// time. Define it for the whole build or not at all, a Simulator of the same
+// machines can't be both.
+
+namespace libsim {
+
+#ifdef LIBSIM_STATS
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+// The same thing, but only known once the Simulator's machines are, so a
+// disabled `if constexpr` branch doesn't get compiled at all
+template <typename...>
+constexpr bool stats_for = stats_enabled;
+
+struct SimStats {
+  using Clock = std::chrono::steady_clock;
+
+  // poll_ns[i] counts polls that took [2^i, 2^(i+1)) ns
+  static constexpr size_t poll_buckets = 40;
+
+  // Transitions taken, one per (machine, state, event kind). Which is which
+  // is up to the Simulator, dump_stats spells it out
+  std::vector<uint64_t> transitions;
+
+  uint64_t evaluations   = 0; // edge watchers looked at, new or their value changed
+  uint64_t hits          = 0; // and actually went off
+  uint64_t cancellations = 0; // OneOf siblings dropped because somebody fired
+
+  // pending events at the start of a tick, at most once every depth_every ticks
+  uint64_t                                   depth_every = 1024;
+  uint64_t                                   max_depth   = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> depth;      // (tick, pending)
+  uint64_t                                   next_depth  = 0;
+
+  uint64_t                           polls = 0;
+  std::array<uint64_t, poll_buckets> poll_ns{};
+
+  void sample_depth(uint64_t now, uint64_t pending) {
+    if (pending > max_depth) max_depth = pending;
+    if (now < next_depth) return;
+    depth.emplace_back(now, pending);
+    next_depth = now + depth_every;
+  }
+
+  void polled(Clock::time_point start) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+
+    size_t bucket = 0;
+    while (ns > 1 && bucket + 1 < poll_buckets) {
+      ns >>= 1;
+      bucket += 1;
+    }
+    poll_ns[bucket] += 1;
+    polls += 1;
+  }
+};
+
+struct NoStats { };
+
+} // namespace libsim
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// For running the same thing over and over with different parameters, each
+// run building its own simulator (and verilated model) from scratch:
+//
+//   auto results = sweep(256, [](size_t i) {
+//     ... build and run a sim for byte i ...
+//     return what_we_got;
+//   });
+//
+// Jobs run on a bunch of threads and the results come back in job order.
+// Every thread starts out with its own slice of the jobs and goes through it
+// front to back. Threads that run out steal the back half of somebody else's
+// leftovers, so a few slow jobs don't leave everyone else waiting.
+//
+// Jobs can't share anything they write, and can't use Catch's REQUIRE and
+// friends either, those only work on the test's own thread. Return whatever
+// needs checking instead.
+
+namespace libsim {
+
+class StealingPool {
+public:
+  // threads counts the caller, 0 means one per core
+  explicit StealingPool(size_t threads = 0)
+    : threads_(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+  { }
+
+  size_t threads() const { return threads_; }
+
+  // Calls job(i) for every i in [0, n) and returns once they're all done.
+  // If any of them throw, the exception from the lowest i gets rethrown after
+  // everything else has finished
+  template <typename Job>
+  void run(size_t n, Job&& job) {
+    size_t workers = std::min(threads_, std::max<size_t>(n, 1));
+
+    std::vector<Slice> slices(workers);
+    for (size_t w = 0; w < workers; ++w) {
+      slices[w].begin = n * w / workers;
+      slices[w].end   = n * (w + 1) / workers;
+    }
+
+    std::vector<std::exception_ptr> errors(n);
+    auto work = [&](size_t self) {
+      size_t i;
+      while (take(slices, self, i) || steal(slices, self, i)) {
+        try {
+          job(i);
+        }
+        catch (...) {
+          errors[i] = std::current_exception();
+        }
+      }
+    };
+
+    std::vector<std::thread> helpers;
+    for (size_t w = 1; w < workers; ++w) helpers.emplace_back(work, w);
+    work(0);
+    for (auto& t : helpers) t.join();
+
+    for (auto& e : errors) {
+      if (e) std::rethrow_exception(e);
+    }
+  }
+
+private:
+  // jobs [begin, end) haven't been started yet
+  struct Slice {
+    std::mutex mutex;
+    size_t     begin = 0;
+    size_t     end   = 0;
+  };
+
+  static bool take(std::vector<Slice>& slices, size_t self, size_t& i) {
+    Slice&                      s = slices[self];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.begin == s.end) return false;
+    i = s.begin++;
+    return true;
+  }
+
+  // Runs the first stolen job right away, the rest goes in our own slice.
+  // Nobody ever adds work, so if everybody is empty we're done
+  static bool steal(std::vector<Slice>& slices, size_t self, size_t& i) {
+    for (size_t k = 1; k < slices.size(); ++k) {
+      Slice& victim = slices[(self + k) % slices.size()];
+
+      size_t begin, end;
+      {
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.begin == victim.end) continue;
+        end   = victim.end;
+        begin = victim.begin + (victim.end - victim.begin) / 2;
+        victim.end = begin;
+      }
+
+      Slice&                      s = slices[self];
+      std::lock_guard<std::mutex> lock(s.mutex);
+      i       = begin;
+      s.begin = begin + 1;
+      s.end   = end;
+      return true;
+    }
+
+    return false;
+  }
+
+  size_t threads_;
+};
+
+// job(i) for every i in [0, n) on a StealingPool, results in order of i
+template <typename Job>
+auto sweep(size_t n, Job&& job, size_t threads = 0) {
+  using Result = std::invoke_result_t<Job&, size_t>;
+  static_assert(!std::is_void_v<Result>, "use StealingPool::run for that");
+
+  // results might not be default constructible
+  std::vector<std::optional<Result>> slots(n);
+  StealingPool(threads).run(n, [&](size_t i) { slots[i].emplace(job(i)); });
+
+  std::vector<Result> results;
+  results.reserve(n);
+  for (auto& r : slots) results.push_back(std::move(*r));
+  return results;
+}
+
+} // namespace libsim
@@ -0,0 +1,328 @@
+#pragma once
+
+#include "DeadlineScan.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Timer queues used by the Simulator. All of them hand out due timers in seq order so
+// the simulator doesn't care which one it is talking to.
+
+namespace libsim {
+
+// Points at a pending event slot in the simulator. Slots get reused, the seq
+// tells the different occupants apart
+struct SlotRef {
+  uint64_t seq;
+  uint32_t slot;
+};
+
+struct TimerRef {
+  uint64_t deadline;
+  SlotRef  ref;
+};
+
+// Plain binary heap on (deadline, seq). Canceled timers are left where they are
+// and dropped when they reach the top, the caller says which ones are still
+// live.
+class TimerHeap {
+public:
+  void add(TimerRef t) {
+    heap_.push_back(t);
+    std::push_heap(heap_.begin(), heap_.end(), later);
+  }
+
+  template <typename Live>
+  void pop_due(uint64_t now, std::vector<SlotRef>& out, Live live) {
+    while (!heap_.empty() && heap_.front().deadline <= now) {
+      std::pop_heap(heap_.begin(), heap_.end(), later);
+      SlotRef r = heap_.back().ref;
+      heap_.pop_back();
+      if (live(r)) out.push_back(r);
+    }
+  }
+
+  template <typename Live>
+  bool next_deadline(uint64_t& deadline, Live live) {
+    // might as well throw away dead timers while we are up here
+    while (!heap_.empty() && !live(heap_.front().ref)) {
+      std::pop_heap(heap_.begin(), heap_.end(), later);
+      heap_.pop_back();
+    }
+
+    if (heap_.empty()) return false;
+    deadline = heap_.front().deadline;
+    return true;
+  }
+
+private:
+  // std::*_heap builds a max heap, so "less" means "fires later"
+  static bool later(TimerRef const& a, TimerRef const& b) {
+    if (a.deadline != b.deadline) return a.deadline > b.deadline;
+    return a.ref.seq > b.ref.seq;
+  }
+
+  std::vector<TimerRef> heap_;
+};
+
+// Hierarchical timing wheel. Level k has 64 buckets, each covering 64^k ticks,
+// and a timer lives on the lowest level where its deadline and the wheel's
+// current time differ. Eleven levels cover all 64 bits of deadline so there's
+// no overflow list.
+//
+// Buckets are intrusive doubly linked lists threaded through the slot index so
+// add and remove are O(1). A timer gets moved down at most once per level
+// before it expires. Bitmaps of the occupied buckets let us jump over empty
+// stretches of time instead of stepping through every bucket.
+class TimerWheel {
+public:
+  TimerWheel() {
+    for (auto& level : heads_) level.fill(nil);
+  }
+
+  void add(TimerRef t) {
+    if (t.ref.slot >= nodes_.size()) nodes_.resize(t.ref.slot + 1);
+
+    Node& n    = nodes_[t.ref.slot];
+    n.deadline = std::max(t.deadline, now_); // late timers fire asap
+    n.seq      = t.ref.seq;
+    link(t.ref.slot);
+  }
+
+  // Does nothing if the timer already expired (or never existed)
+  void remove(SlotRef r) {
+    if (r.slot >= nodes_.size()) return;
+
+    Node& n = nodes_[r.slot];
+    if (n.linked && n.seq == r.seq) unlink(r.slot);
+  }
+
+  void pop_due(uint64_t now, std::vector<SlotRef>& out) {
+    if (now < now_) return;
+
+    size_t first = out.size();
+    while (true) {
+      // everything on level 0 is inside of the current block of 64 ticks
+      uint64_t block_end = now_ | (slots - 1);
+      uint64_t limit     = std::min(now, block_end);
+      uint64_t due       = occupied_[0] & span(now_ & (slots - 1), limit & (slots - 1));
+      while (due) {
+        drain(0, __builtin_ctzll(due), &out);
+        due &= due - 1;
+      }
+
+      if (now <= block_end) break;
+
+      // level 0 is empty. The lowest occupied level has the next timer, and
+      // its first occupied bucket starts the next stretch of time worth
+      // looking at
+      unsigned level = 1;
+      while (level < levels && !occupied_[level]) level += 1;
+      if (level == levels) break;
+
+      unsigned bucket = __builtin_ctzll(occupied_[level]);
+      uint64_t start  = (now_ & above(level)) | ((uint64_t)bucket << (bits * level));
+      if (start > now) break;
+
+      now_ = start;
+      drain(level, bucket, nullptr); // pushes everything down a level or more
+    }
+
+    now_ = now;
+
+    // buckets get filled from different levels so the order is a bit mixed up
+    std::sort(out.begin() + first, out.end(), [](SlotRef a, SlotRef b) {
+      return a.seq < b.seq;
+    });
+  }
+
+  bool next_deadline(uint64_t& deadline) const {
+    if (occupied_[0]) {
+      deadline = (now_ & ~(uint64_t)(slots - 1)) | __builtin_ctzll(occupied_[0]);
+      return true;
+    }
+
+    for (unsigned level = 1; level < levels; ++level) {
+      if (!occupied_[level]) continue;
+
+      // timers in the first occupied bucket aren't sorted, have to look
+      unsigned bucket = __builtin_ctzll(occupied_[level]);
+      deadline = UINT64_MAX;
+      for (uint32_t i = heads_[level][bucket]; i != nil; i = nodes_[i].next) {
+        deadline = std::min(deadline, nodes_[i].deadline);
+      }
+      return true;
+    }
+
+    return false;
+  }
+
+private:
+  static constexpr unsigned bits   = 6;
+  static constexpr unsigned slots  = 1u << bits;
+  static constexpr unsigned levels = 11;
+  static constexpr uint32_t nil    = UINT32_MAX;
+
+  struct Node {
+    uint64_t deadline = 0;
+    uint64_t seq      = 0;
+    uint32_t prev     = nil;
+    uint32_t next     = nil;
+    uint8_t  level    = 0;
+    uint8_t  bucket   = 0;
+    bool     linked   = false;
+  };
+
+  // bits [lo, hi] set
+  static uint64_t span(unsigned lo, unsigned hi) {
+    uint64_t upto = hi == 63 ? ~0ull : (1ull << (hi + 1)) - 1;
+    return upto & ~((1ull << lo) - 1);
+  }
+
+  // mask of the time bits handled by levels above this one
+  static uint64_t above(unsigned level) {
+    unsigned shift = bits * (level + 1);
+    return shift >= 64 ? 0 : ~((1ull << shift) - 1);
+  }
+
+  void link(uint32_t i) {
+    Node&    n     = nodes_[i];
+    uint64_t diff  = n.deadline ^ now_;
+    unsigned level = diff ? (63 - __builtin_clzll(diff)) / bits : 0;
+
+    n.level  = level;
+    n.bucket = (n.deadline >> (bits * level)) & (slots - 1);
+    n.prev   = nil;
+    n.next   = heads_[level][n.bucket];
+    n.linked = true;
+
+    if (n.next != nil) nodes_[n.next].prev = i;
+    heads_[level][n.bucket] = i;
+    occupied_[level] |= 1ull << n.bucket;
+  }
+
+  void unlink(uint32_t i) {
+    Node& n = nodes_[i];
+
+    if (n.prev != nil) nodes_[n.prev].next = n.next;
+    else               heads_[n.level][n.bucket] = n.next;
+    if (n.next != nil) nodes_[n.next].prev = n.prev;
+
+    if (heads_[n.level][n.bucket] == nil) {
+      occupied_[n.level] &= ~(1ull << n.bucket);
+    }
+
+    n.linked = false;
+  }
+
+  // Empties a bucket. Expired timers go to out, or get relinked relative to
+  // the current time if out is null
+  void drain(unsigned level, unsigned bucket, std::vector<SlotRef>* out) {
+    uint32_t i = heads_[level][bucket];
+    heads_[level][bucket] = nil;
+    occupied_[level] &= ~(1ull << bucket);
+
+    while (i != nil) {
+      uint32_t next = nodes_[i].next;
+      nodes_[i].linked = false;
+      if (out) out->push_back(SlotRef{nodes_[i].seq, i});
+      else     link(i);
+      i = next;
+    }
+  }
+
+  uint64_t                                        now_ = 0;
+  std::vector<Node>                               nodes_; // indexed by slot
+  std::array<std::array<uint32_t, slots>, levels> heads_;
+  std::array<uint64_t, levels>                    occupied_{};
+};
+
+// No order at all, just flat arrays (deadlines in one, everything else in the
+// others) that get scanned with whatever SIMD the cpu has. Add and remove are
+// O(1), and the earliest deadline is kept around so ticks where nothing is due
+// don't look at anything. Ticks where something is due look at everything,
+// which is fine when there aren't many timers or a lot of them come due
+// together (clocks!), and terrible for a pile of far off timeouts.
+class TimerScan {
+public:
+  void add(TimerRef t) {
+    if (t.ref.slot >= pos_.size()) pos_.resize(t.ref.slot + 1, nil);
+
+    pos_[t.ref.slot] = deadlines_.size();
+    deadlines_.push_back(t.deadline);
+    refs_.push_back(t.ref);
+    min_ = std::min(min_, t.deadline);
+  }
+
+  // Does nothing if the timer already expired (or never existed)
+  void remove(SlotRef r) {
+    if (r.slot >= pos_.size() || pos_[r.slot] == nil) return;
+    if (refs_[pos_[r.slot]].seq != r.seq) return;
+
+    erase(pos_[r.slot]);
+    stale_ = true; // min_ might be too early now, which is harmless
+  }
+
+  void pop_due(uint64_t now, std::vector<SlotRef>& out) {
+    if (now < min_) return;
+
+    size_t n = deadlines_.size();
+    if (due_.size() < n) due_.resize(n);
+
+    uint64_t next;
+    size_t   count = kernel_(deadlines_.data(), n, now, due_.data(), next);
+    min_   = next;
+    stale_ = false;
+
+    // back to front so erasing doesn't move anything we still need
+    size_t first = out.size();
+    for (size_t k = count; k-- > 0;) {
+      out.push_back(refs_[due_[k]]);
+      erase(due_[k]);
+    }
+
+    std::sort(out.begin() + first, out.end(), [](SlotRef a, SlotRef b) {
+      return a.seq < b.seq;
+    });
+  }
+
+  bool next_deadline(uint64_t& deadline) {
+    if (deadlines_.empty()) return false;
+
+    if (stale_) {
+      min_   = *std::min_element(deadlines_.begin(), deadlines_.end());
+      stale_ = false;
+    }
+    deadline = min_;
+    return true;
+  }
+
+private:
+  static constexpr uint32_t nil = UINT32_MAX;
+
+  // swap with the last one
+  void erase(uint32_t i) {
+    pos_[refs_[i].slot] = nil;
+
+    uint32_t last = deadlines_.size() - 1;
+    if (i != last) {
+      deadlines_[i]       = deadlines_[last];
+      refs_[i]            = refs_[last];
+      pos_[refs_[i].slot] = i;
+    }
+    deadlines_.pop_back();
+    refs_.pop_back();
+  }
+
+  scan::Kernel          kernel_ = scan::best();
+  std::vector<uint64_t> deadlines_;          // the only thing the scan reads
+  std::vector<SlotRef>  refs_;               // same index as deadlines_
+  std::vector<uint32_t> pos_;                // slot -> index, or nil
+  std::vector<uint32_t> due_;                // scratch
+  uint64_t              min_   = UINT64_MAX; // never later than the real one
+  bool                  stale_ = false;
+};
+
+} // namespace libsim
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bare bones fork/join pool for running one tick's worth of machine groups.
+// run() hands out job indices to the workers and the calling thread, and
+// returns once every job is done and every worker is back, so each call is a
+// barrier.
+//
+// Ticks are short, so workers spin for a bit before going to sleep on the
+// condition variable.
+
+namespace libsim {
+
+class WorkerPool {
+public:
+  // threads counts the caller, so 1 means no extra threads at all
+  explicit WorkerPool(size_t threads) {
+    for (size_t i = 1; i < threads; ++i) workers_.emplace_back([this] { work(); });
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : workers_) t.join();
+  }
+
+  WorkerPool(WorkerPool const&)            = delete;
+  WorkerPool& operator=(WorkerPool const&) = delete;
+
+  size_t threads() const { return workers_.size() + 1; }
+
+  // Calls job(i) for every i in [0, n). job must not throw
+  template <typename Job>
+  void run(size_t n, Job& job) {
+    if (n == 0) return;
+    if (workers_.empty() || n == 1) {
+      for (size_t i = 0; i < n; ++i) job(i);
+      return;
+    }
+
+    ctx_  = &job;
+    call_ = [](void* ctx, size_t i) { (*static_cast<Job*>(ctx))(i); };
+    jobs_ = n;
+    next_.store(0, std::memory_order_relaxed);
+    arrived_.store(0, std::memory_order_relaxed);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      generation_.fetch_add(1, std::memory_order_release);
+    }
+    wake_.notify_all();
+
+    // everyone has to check in, not just finish the jobs, so nobody is still
+    // looking at this run's job when the next one gets set up
+    help();
+    while (arrived_.load(std::memory_order_acquire) != workers_.size()) {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  // grab jobs until there are none left
+  void help() {
+    for (size_t i; (i = next_.fetch_add(1, std::memory_order_relaxed)) < jobs_;) {
+      call_(ctx_, i);
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+
+    while (true) {
+      // spin a little, the next tick is usually right around the corner
+      for (int i = 0; i < 2000 && generation_.load(std::memory_order_acquire) == seen; ++i) {
+        std::this_thread::yield();
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] {
+          return stop_ || generation_.load(std::memory_order_acquire) != seen;
+        });
+        if (stop_) return;
+        seen = generation_.load(std::memory_order_acquire);
+      }
+
+      help();
+      arrived_.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::mutex               mutex_;
+  std::condition_variable  wake_;
+  bool                     stop_ = false;
+  std::atomic<uint64_t>    generation_{0}; // bumped for every run()
+
+  void*                    ctx_  = nullptr;
+  void                   (*call_)(void*, size_t) = nullptr;
+  size_t                   jobs_ = 0;
+  std::atomic<size_t>      next_{0};
+  std::atomic<size_t>      arrived_{0};    // workers done with this run
+};
+
+} // namespace libsim
@@ -0,0 +1,685 @@
+#include "../Federation.h"
+#include "../Simulator.h"
+#include "../Sweep.h"
+
+#include <fmt/format.h>
+
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+using namespace libsim;
+
+// Keep track of how much heap is in use, so each configuration can report
+// its own peak instead of whatever the process high water mark happens to be
+namespace heap {
+std::atomic<size_t> live{0};
+std::atomic<size_t> peak{0};
+
+void reset_peak() { peak = live.load(); }
+} // namespace heap
+
+// noinline: once gcc inlines these into std::allocator/unique_ptr it sees
+// malloc() paired with delete (or new with free()) and complains
+__attribute__((noinline)) void* operator new(size_t n)
+{
+  void* p = malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+
+  size_t now = heap::live += malloc_usable_size(p);
+  if (now > heap::peak) heap::peak = now;
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  heap::live -= malloc_usable_size(p); // 0 for null
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+  heap::live -= malloc_usable_size(p);
+  free(p);
+}
+
+namespace {
+
+// Parks a pile of timeouts far enough in the future that they never come due
+// while we are measuring. These should cost (close to) nothing per tick
+struct Sleeper {
+  MAKE_STATE(Sleeping);
+
+  Sleeper(size_t n) : n(n) { }
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Sleeping{};
+    AllOf all;
+    for (size_t i = 0; i < n; ++i) all.events.push_back(Timeout{1ull << 40});
+    return all;
+  }
+
+  Events transition(Sleeping, Timeout) {
+    return None{};
+  }
+
+  auto currentState() const { return state; }
+
+  size_t            n;
+  States<Sleeping>  state;
+};
+
+// Something needs to actually fire every tick
+struct Ticker {
+  MAKE_STATE(Ticking);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Ticking{};
+    return Only{Timeout{1}};
+  }
+
+  Events transition(Ticking, Timeout) {
+    return Only{Timeout{1}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Ticking> state;
+};
+
+// Sleeps for a long time, over and over again
+struct Napper {
+  MAKE_STATE(Napping);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Napping{};
+    return Only{Timeout{1000}};
+  }
+
+  Events transition(Napping, Timeout) {
+    naps += 1;
+    return Only{Timeout{1000}};
+  }
+
+  auto currentState() const { return state; }
+
+  size_t          naps = 0;
+  States<Napping> state;
+};
+
+// Keeps n timers going at once, each one rearms itself with the same duration
+// when it fires. Durations are spread out between 1 and 1024 ticks (clock
+// half periods, SCK toggles, watchdogs...)
+struct Juggler {
+  MAKE_STATE(Juggling);
+
+  Juggler(size_t n) : n(n) { }
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Juggling{};
+    AllOf all;
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t duration = 1 + (i * 2654435761u) % 1024;
+      all.events.push_back(Timeout{duration, duration});
+    }
+    return all;
+  }
+
+  Events transition(Juggling, Timeout t) {
+    fired += 1;
+    return Only{Timeout{t.user_id, t.user_id}};
+  }
+
+  auto currentState() const { return state; }
+
+  size_t           n;
+  size_t           fired = 0;
+  States<Juggling> state;
+};
+
+// Watches a bunch of values that never change
+struct Lurker {
+  MAKE_STATE(Lurking);
+
+  Lurker(std::vector<uint8_t> const& values, size_t n) : values(values), n(n) { }
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Lurking{};
+    AllOf all;
+    for (size_t i = 0; i < n; ++i) {
+      all.events.push_back(RisingEdge{&values[i % values.size()]});
+    }
+    return all;
+  }
+
+  Events transition(Lurking, RisingEdge) {
+    return None{};
+  }
+
+  auto currentState() const { return state; }
+
+  std::vector<uint8_t> const& values;
+  size_t                      n;
+  States<Lurking>             state;
+};
+
+// Keeps n OneOf groups of k timeouts in the air. Whenever a group resolves it
+// gets replaced by a new one
+struct Chooser {
+  MAKE_STATE(Choosing);
+
+  Chooser(size_t n, size_t k) : n(n), k(k) { }
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Choosing{};
+    AllOf all;
+    for (size_t i = 0; i < n; ++i) all.events.push_back(Timeout{1 + i % 64});
+    return all;
+  }
+
+  Events transition(Choosing, Timeout) {
+    fired += 1;
+    OneOf one;
+    for (size_t i = 0; i < k; ++i) one.events.push_back(Timeout{64 + i});
+    return one;
+  }
+
+  auto currentState() const { return state; }
+
+  size_t           n;
+  size_t           k;
+  size_t           fired = 0;
+  States<Choosing> state;
+};
+
+// Flips a value every tick
+struct Toggler {
+  MAKE_STATE(Toggling);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Toggling{};
+    return Only{Timeout{1}};
+  }
+
+  Events transition(Toggling, Timeout) {
+    value ^= 1;
+    return Only{Timeout{1}};
+  }
+
+  auto currentState() const { return state; }
+
+  uint8_t          value = 0;
+  States<Toggling> state;
+};
+
+// n watchers on one value, each one goes right back to watching after it
+// fires
+struct Follower {
+  MAKE_STATE(Following);
+
+  Follower(uint8_t const* value, size_t n) : value(value), n(n) { }
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Following{};
+    AllOf all;
+    for (size_t i = 0; i < n; ++i) all.events.push_back(RisingEdge{value});
+    return all;
+  }
+
+  Events transition(Following, RisingEdge) {
+    fired += 1;
+    return Only{RisingEdge{value}};
+  }
+
+  auto currentState() const { return state; }
+
+  uint8_t const*    value;
+  size_t            n;
+  size_t            fired = 0;
+  States<Following> state;
+};
+
+// Stands in for a tiny verilated model
+struct Model {
+  uint8_t  clk = 0;
+  uint64_t evals = 0;
+
+  void eval() { evals += clk; }
+};
+
+// Clocks a Model the way a testbench machine has to without ClockSource: a
+// transition per edge, racing a done flag
+struct ModelClock {
+  MAKE_STATE(Clocking);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Clocking{};
+    return OneOf{Timeout{half_period}, RisingEdge{&done}};
+  }
+
+  Events transition(Clocking, Timeout) {
+    model->clk ^= 1;
+    model->eval();
+    return OneOf{Timeout{half_period}, RisingEdge{&done}};
+  }
+
+  Events transition(Clocking, RisingEdge) { return None{}; }
+
+  auto currentState() const { return state; }
+
+  Model*           model;
+  uint64_t         half_period = 1;
+  uint8_t          done        = 0;
+  States<Clocking> state;
+};
+
+// Burns some cpu on every tick, like a big verilated model's eval() would
+struct Grinder {
+  MAKE_STATE(Grinding);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Grinding{};
+    return Only{Timeout{0}};
+  }
+
+  Events transition(Grinding, Timeout) {
+    for (size_t i = 0; i < work; ++i) x = x * 6364136223846793005ull + 1;
+    return Only{Timeout{0}};
+  }
+
+  auto currentState() const { return state; }
+
+  size_t           work = 2000;
+  uint64_t         x    = 1;
+  States<Grinding> state;
+};
+
+// Ticker is about as cheap as a machine gets, so a pile of them measures the
+// per machine overhead
+template <size_t>
+using TickerRef = std::reference_wrapper<Ticker>;
+
+template <size_t... Is>
+auto tickers(std::array<Ticker, sizeof...(Is)>& ts, std::index_sequence<Is...>)
+{
+  return SimBuilder<TickerRef<Is>...>({std::ref(ts[Is])...}, SimOptions{});
+}
+
+template <size_t>
+using GrinderRef = std::reference_wrapper<Grinder>;
+
+// each one in its own group
+template <size_t... Is>
+auto grinders(std::array<Grinder, sizeof...(Is)>& gs, size_t threads,
+              std::index_sequence<Is...>)
+{
+  SimOptions opts;
+  opts.threads = threads;
+  return SimBuilder<GrinderRef<Is>...>({std::ref(gs[Is])...}, opts);
+}
+
+constexpr TimerBackend backends[] = {
+  TimerBackend::Heap, TimerBackend::Wheel, TimerBackend::Scan,
+};
+
+char const* name(TimerBackend backend)
+{
+  switch (backend) {
+    case TimerBackend::Wheel: return "wheel";
+    case TimerBackend::Scan:  return "scan";
+    default:                  return "heap";
+  }
+}
+
+struct Sample {
+  RunStats run;
+  double   ns;
+};
+
+template <typename Run>
+Sample timed(Run run)
+{
+  auto     start = std::chrono::steady_clock::now();
+  RunStats stats = run();
+  auto     end   = std::chrono::steady_clock::now();
+  return {stats, std::chrono::duration<double, std::nano>(end - start).count()};
+}
+
+// One JSON object per line so the output can be fed to jq/pandas/diff.
+// params is the bench specific part, already formatted
+void report(char const* bench, std::string const& params, Sample s)
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  uint64_t ticks  = std::max<uint64_t>(s.run.ticks, 1);
+  uint64_t events = std::max<uint64_t>(s.run.events, 1);
+
+  fmt::print("{{\"bench\": \"{}\", {}, \"ticks\": {}, \"events\": {}, "
+             "\"ns_per_tick\": {:.1f}, \"ns_per_event\": {:.1f}, "
+             "\"events_per_s\": {:.0f}, \"peak_heap_bytes\": {}, "
+             "\"max_rss_kb\": {}}}\n",
+             bench, params, s.run.ticks, s.run.events,
+             s.ns / ticks, s.ns / events, s.run.events / (s.ns * 1e-9),
+             heap::peak.load(), usage.ru_maxrss);
+  std::fflush(stdout);
+}
+
+template <size_t N>
+void machine_count_one()
+{
+  constexpr size_t ticks = 10000;
+
+  heap::reset_peak();
+  std::array<Ticker, N> ts;
+  auto sim = tickers(ts, std::make_index_sequence<N>{}).get_sim();
+
+  report("machine_count", fmt::format("\"machines\": {}", N),
+         timed([&] { return sim.run_for(ticks); }));
+}
+
+void machine_count()
+{
+  machine_count_one<1>();
+  machine_count_one<4>();
+  machine_count_one<16>();
+  machine_count_one<64>();
+}
+
+// Cheap machines again, so the recorder's share of the time shows. Then the
+// same recording replayed on a fresh bunch of them
+void recording()
+{
+  constexpr size_t ticks = 10000;
+  constexpr size_t n     = 16;
+
+  std::vector<uint8_t> bytes;
+  for (char const* mode : {"off", "memory", "replay"}) {
+    heap::reset_peak();
+    std::array<Ticker, n> ts;
+    auto     sim = tickers(ts, std::make_index_sequence<n>{}).get_sim();
+    Recorder recorder;
+
+    Sample s;
+    if (std::strcmp(mode, "replay") == 0) {
+      Playback playback(bytes);
+      s = timed([&] { return sim.replay(playback); });
+    }
+    else {
+      if (std::strcmp(mode, "memory") == 0) sim.record(&recorder);
+      s     = timed([&] { return sim.run_for(ticks); });
+      bytes = recorder.bytes();
+    }
+
+    report("record",
+           fmt::format("\"machines\": {}, \"mode\": \"{}\", \"bytes\": {}",
+                       n, mode, bytes.size()),
+           s);
+  }
+}
+
+// A model clocked by a machine versus by the simulator itself. Events only
+// counts transitions, so look at ns_per_tick
+void clocks()
+{
+  constexpr size_t ticks = 100000;
+
+  for (bool native : {false, true}) {
+    for (uint64_t half_period : {1, 4}) {
+      for (bool skipping : {false, true}) {
+        heap::reset_peak();
+        Model      model;
+        ModelClock mc;
+        mc.model       = &model;
+        mc.half_period = half_period;
+
+        ClockSource c;
+        c.signal      = &model.clk;
+        c.half_period = half_period;
+        c.ctx         = &model;
+        c.on_edge     = [](void* m, uint64_t) { static_cast<Model*>(m)->eval(); };
+
+        Sample s;
+        if (native) {
+          // needs a machine, any machine
+          Sleeper idle(0);
+          auto sim = SimBuilder<>().add(idle).clock(c).time_skipping(skipping).get_sim();
+          s = timed([&] { return sim.run_for(ticks); });
+        }
+        else {
+          auto sim = SimBuilder<>().add(mc).time_skipping(skipping).get_sim();
+          s = timed([&] { return sim.run_for(ticks); });
+        }
+
+        report("clock",
+               fmt::format("\"native\": {}, \"half_period\": {}, \"skipping\": {}",
+                           native, half_period, skipping),
+               s);
+      }
+    }
+  }
+}
+
+// Only says something on a box with more than one core
+void parallel_groups()
+{
+  constexpr size_t ticks  = 2000;
+  constexpr size_t groups = 8;
+
+  for (size_t threads : {1, 2, 4, 8}) {
+    heap::reset_peak();
+    std::array<Grinder, groups> gs;
+    auto sim = grinders(gs, threads, std::make_index_sequence<groups>{}).get_sim();
+
+    report("parallel_groups",
+           fmt::format("\"groups\": {}, \"threads\": {}, \"cores\": {}",
+                       groups, threads, std::thread::hardware_concurrency()),
+           timed([&] { return sim.run_for(ticks); }));
+  }
+}
+
+// A ring of partitions, each one grinding away and passing a value on to the
+// next one. The longer the links, the further apart the partitions get to
+// drift. Same deal as parallel_groups, needs cores to say anything
+void federation()
+{
+  constexpr size_t ticks = 2000;
+  constexpr size_t parts = 4;
+
+  for (bool optimistic : {false, true}) {
+    for (uint64_t latency : {1, 10, 100}) {
+      for (bool threaded : {false, true}) {
+        heap::reset_peak();
+
+        std::array<Grinder, parts> gs;
+        std::array<Toggler, parts> ts;
+        std::array<uint8_t, parts> ins{};
+
+        using Sim = decltype(SimBuilder<>().add(gs[0]).add(ts[0]).get_sim());
+        std::vector<std::unique_ptr<Sim>> sims;
+        Federation f({optimistic});
+        for (size_t i = 0; i < parts; ++i) {
+          sims.push_back(std::make_unique<Sim>(SimBuilder<>().add(gs[i]).add(ts[i]).get_sim()));
+          f.add(*sims.back());
+        }
+        for (size_t i = 0; i < parts; ++i) {
+          f.link(i, &ts[i].value, (i + 1) % parts, &ins[(i + 1) % parts], latency);
+        }
+
+        Sample s = timed([&] { return f.run_for(ticks, threaded); });
+        report("federation",
+               fmt::format("\"partitions\": {}, \"latency\": {}, \"optimistic\": {}, "
+                           "\"threaded\": {}, \"rollbacks\": {}, \"cores\": {}",
+                           parts, latency, optimistic, threaded, f.rollbacks(),
+                           std::thread::hardware_concurrency()),
+               s);
+      }
+    }
+  }
+}
+
+// Lots of independent little simulations, the way a parameter sweep does
+// them. Only says something with more than one core
+void sweeps()
+{
+  constexpr size_t jobs  = 256;
+  constexpr size_t ticks = 200;
+
+  for (size_t threads : {1, 2, 4, 8}) {
+    heap::reset_peak();
+
+    auto job = [&](size_t) {
+      Grinder g;
+      g.work   = 500;
+      auto sim = SimBuilder<>().add(g).get_sim();
+      return sim.run_for(ticks);
+    };
+
+    Sample s = timed([&] {
+      RunStats total;
+      for (RunStats r : sweep(jobs, job, threads)) {
+        total.ticks  += r.ticks;
+        total.events += r.events;
+      }
+      return total;
+    });
+    report("sweep",
+           fmt::format("\"jobs\": {}, \"threads\": {}, \"cores\": {}",
+                       jobs, threads, std::thread::hardware_concurrency()),
+           s);
+  }
+}
+
+void pending_timeouts()
+{
+  constexpr size_t ticks = 10000;
+
+  for (TimerBackend backend : backends) {
+    for (size_t n : {0, 1, 10, 100, 1000, 10000, 100000}) {
+      heap::reset_peak();
+      Sleeper s(n);
+      Ticker  t;
+      auto sim = SimBuilder<>().add(s).add(t).timers(backend).get_sim();
+
+      report("pending_timeouts",
+             fmt::format("\"timers\": \"{}\", \"n\": {}", name(backend), n),
+             timed([&] { return sim.run_for(ticks); }));
+    }
+  }
+}
+
+void timer_churn()
+{
+  constexpr size_t ticks = 5000;
+
+  for (TimerBackend backend : backends) {
+    for (size_t n : {100, 10000, 100000}) {
+      heap::reset_peak();
+      Juggler j(n);
+      auto sim = SimBuilder<>().add(j).timers(backend).get_sim();
+
+      report("timer_churn",
+             fmt::format("\"timers\": \"{}\", \"n\": {}", name(backend), n),
+             timed([&] { return sim.run_for(ticks); }));
+    }
+  }
+}
+
+void sparse_timeouts()
+{
+  constexpr size_t naps = 1000;
+
+  for (bool skipping : {false, true}) {
+    heap::reset_peak();
+    Napper n;
+    auto sim = SimBuilder<>().add(n).time_skipping(skipping).get_sim();
+
+    report("sparse_timeouts", fmt::format("\"skipping\": {}", skipping),
+           timed([&] { return sim.run_until([&] { return n.naps == naps; }); }));
+  }
+}
+
+void idle_watchers()
+{
+  constexpr size_t ticks = 10000;
+
+  for (size_t signals : {1, 100, 1000}) {
+    for (size_t n : {1, 100, 10000}) {
+      heap::reset_peak();
+      std::vector<uint8_t> values(std::min(signals, n), 0);
+      Lurker l(values, n);
+      Ticker t;
+      auto sim = SimBuilder<>().add(l).add(t).get_sim();
+
+      report("idle_watchers",
+             fmt::format("\"signals\": {}, \"n\": {}", values.size(), n),
+             timed([&] { return sim.run_for(ticks); }));
+    }
+  }
+}
+
+void oneof_fanout()
+{
+  constexpr size_t ticks = 2000;
+
+  for (size_t k : {2, 8}) {
+    for (size_t n : {10, 1000, 10000}) {
+      heap::reset_peak();
+      Chooser c(n, k);
+      auto sim = SimBuilder<>().add(c).get_sim();
+
+      report("oneof_fanout", fmt::format("\"k\": {}, \"n\": {}", k, n),
+             timed([&] { return sim.run_for(ticks); }));
+    }
+  }
+}
+
+void busy_watchers()
+{
+  constexpr size_t ticks = 2000;
+
+  for (size_t n : {1, 100, 1000}) {
+    heap::reset_peak();
+    Toggler  t;
+    Follower f(&t.value, n);
+    auto sim = SimBuilder<>().add(t).add(f).get_sim();
+
+    report("busy_watchers", fmt::format("\"n\": {}", n),
+           timed([&] { return sim.run_for(ticks); }));
+  }
+}
+
+} // namespace
+
+// simbench [bench...], runs everything if nothing is named
+int main(int argc, char** argv)
+{
+  std::pair<char const*, void (*)()> benches[] = {
+    {"machine_count",    machine_count},
+    {"pending_timeouts", pending_timeouts},
+    {"sparse_timeouts",  sparse_timeouts},
+    {"timer_churn",      timer_churn},
+    {"idle_watchers",    idle_watchers},
+    {"oneof_fanout",     oneof_fanout},
+    {"busy_watchers",    busy_watchers},
+    {"record",           recording},
+    {"clock",            clocks},
+    {"parallel_groups",  parallel_groups},
+    {"federation",       federation},
+    {"sweep",            sweeps},
+  };
+
+  for (auto [name, bench] : benches) {
+    bool wanted = argc == 1;
+    for (int i = 1; i < argc; ++i) wanted |= std::strcmp(argv[i], name) == 0;
+    if (wanted) bench();
+  }
+}
@@ -0,0 +1,182 @@
+#include "../../catch/catch.hpp"
+
+#include "../Simulator.h"
+
+#include <cstdlib>
+#include <new>
+
+// Counts every trip to the allocator while `counting` is set. This replaces
+// operator new for the whole test binary, so keep the window small (Catch
+// allocates too).
+namespace {
+bool   counting    = false;
+size_t allocations = 0;
+}
+
+void* operator new(size_t n)
+{
+  if (counting) allocations += 1;
+  if (void* p = malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+
+// noinline: once gcc inlines these into std::allocator it sees new paired with
+// free() and complains
+__attribute__((noinline)) void operator delete(void* p) noexcept         { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+using namespace libsim;
+
+namespace {
+
+template <typename F>
+size_t count_allocations(F&& f)
+{
+  allocations = 0;
+  counting    = true;
+  f();
+  counting    = false;
+  return allocations;
+}
+
+constexpr TimerBackend backends[] = {
+  TimerBackend::Heap, TimerBackend::Wheel, TimerBackend::Scan,
+};
+
+} // namespace
+
+TEST_CASE("steady state polls don't allocate", "[libsim][alloc]")
+{
+  // one machine that keeps a timer going and flips a value, one that keeps
+  // watching the value
+  struct Flipper {
+    MAKE_STATE(Flipping);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Flipping{};
+      return Only{Timeout{3}};
+    }
+
+    Events transition(Flipping, Timeout) {
+      value = !value;
+      return Only{Timeout{3}};
+    }
+
+    auto const& currentState() const { return state; }
+
+    States<Flipping> state = Uninitialized{};
+    bool             value = false;
+  };
+
+  struct Watcher {
+    MAKE_STATE(Watching);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Watching{};
+      return Only{RisingEdge{that}};
+    }
+
+    Events transition(Watching, RisingEdge) {
+      seen += 1;
+      return Only{RisingEdge{that}};
+    }
+
+    auto currentState() const { return state; } // copies are fine too
+
+    States<Watching> state = Uninitialized{};
+    bool const*      that;
+    size_t           seen = 0;
+  };
+
+  for (TimerBackend backend : backends) {
+    Flipper f;
+    Watcher w;
+    w.that = &f.value;
+
+    auto sim = SimBuilder<>().add(f).add(w).timers(backend).get_sim();
+
+    // let all of the scratch space grow to size
+    for (size_t i = 0; i < 100; ++i) sim.poll();
+
+    size_t before = w.seen;
+    size_t n = count_allocations([&] {
+      for (size_t i = 0; i < 10000; ++i) sim.poll();
+    });
+
+    REQUIRE(w.seen > before);
+    REQUIRE(n == 0);
+  }
+}
+
+TEST_CASE("small event lists don't allocate", "[libsim][alloc]")
+{
+  // what VMachine does every half clock: wait for the timer, or an edge
+  // that'll cut it short
+  struct Chooser {
+    MAKE_STATE(Choosing);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Choosing{};
+      return OneOf{Timeout{2}, RisingEdge{&never}};
+    }
+
+    Events transition(Choosing, Timeout) {
+      chose += 1;
+      return OneOf{Timeout{2}, RisingEdge{&never}};
+    }
+
+    Events transition(Choosing, RisingEdge) {
+      throw std::logic_error("never means never");
+    }
+
+    auto const& currentState() const { return state; }
+
+    States<Choosing> state = Uninitialized{};
+    bool             never = false;
+    size_t           chose = 0;
+  };
+
+  // waits for a few timers at once and starts over once they're all done
+  struct Gatherer {
+    MAKE_STATE(Gathering);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Gathering{};
+      return again();
+    }
+
+    Events transition(Gathering, Timeout) {
+      if (--left != 0) return None{};
+      rounds += 1;
+      return again();
+    }
+
+    Events again() {
+      left = 4;
+      return AllOf{Timeout{1}, Timeout{2}, Timeout{3}, Timeout{4}};
+    }
+
+    auto const& currentState() const { return state; }
+
+    States<Gathering> state  = Uninitialized{};
+    size_t            left   = 0;
+    size_t            rounds = 0;
+  };
+
+  REQUIRE(!AllOf{Timeout{1}, Timeout{2}, Timeout{3}, Timeout{4}}.events.spilled());
+
+  for (TimerBackend backend : backends) {
+    Chooser  c;
+    Gatherer g;
+
+    auto sim = SimBuilder<>().add(c).add(g).timers(backend).get_sim();
+    sim.run_for(100);
+
+    size_t chose = c.chose, rounds = g.rounds;
+    size_t n = count_allocations([&] { sim.run_for(10000); });
+
+    REQUIRE(c.chose > chose);
+    REQUIRE(g.rounds > rounds);
+    REQUIRE(n == 0);
+  }
+}
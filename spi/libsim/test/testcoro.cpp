@@ -0,0 +1,181 @@
+#include "../../catch/catch.hpp"
+
+#include "../Coroutine.h"
+
+#include <functional>
+
+using namespace libsim;
+
+namespace {
+
+struct Wires {
+  uint8_t sck  = 0;
+  uint8_t mosi = 0;
+  uint8_t ssel = 0;
+};
+
+// What a receiver saw
+struct Received {
+  uint8_t               value     = 0;
+  std::vector<uint64_t> edges;            // when SCK went up
+  bool                  timed_out = false;
+  bool                  done      = false;
+};
+
+// Shifts a byte out msb first, the way t1::Master does
+struct Master {
+  MAKE_STATE(ClockUp);
+  MAKE_STATE(ClockDown);
+  MAKE_STATE(Done);
+
+  Events transition(Uninitialized, InitEvent) {
+    w->ssel  = 1;
+    curr_bit = 8;
+    state    = ClockDown{};
+    return Only{Timeout{half_period}};
+  }
+
+  Events transition(ClockDown, Timeout) {
+    if (curr_bit == 0) {
+      state = Done{};
+      return None{};
+    }
+
+    w->mosi   = (value >> (curr_bit - 1)) & 1;
+    w->sck    = 1;
+    state     = ClockUp{};
+    curr_bit -= 1;
+    return Only{Timeout{half_period}};
+  }
+
+  Events transition(ClockUp, Timeout) {
+    w->sck  = 0;
+    w->mosi = 0;
+    state   = ClockDown{};
+    return Only{Timeout{half_period}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<ClockUp, ClockDown, Done> state = Uninitialized{};
+  Wires*                           w;
+  uint8_t                          value;
+  uint64_t                         half_period = 10;
+  size_t                           curr_bit;
+};
+
+// Same thing, as a coroutine
+CoMachine master(FramePool&, Wires* w, uint8_t value, uint64_t half_period = 10)
+{
+  w->ssel = 1;
+  for (int bit = 7; bit >= 0; --bit) {
+    co_await Timeout{half_period};
+    w->mosi = (value >> bit) & 1;
+    w->sck  = 1;
+
+    co_await Timeout{half_period};
+    w->sck  = 0;
+    w->mosi = 0;
+  }
+}
+
+// Picks up a byte, gives up if the clock stops for too long
+CoMachine receiver(FramePool&, Wires const* w, Received* out,
+                   std::function<uint64_t()> const* clock)
+{
+  for (int bit = 0; bit < 8; ++bit) {
+    auto ev = co_await OneOf{RisingEdge{&w->sck}, Timeout{100}};
+    if (std::holds_alternative<Timeout>(ev)) {
+      out->timed_out = true;
+      co_return;
+    }
+
+    out->value = out->value << 1 | w->mosi;
+    out->edges.push_back((*clock)());
+  }
+
+  out->done = true;
+}
+
+CoMachine grumpy(FramePool&, uint64_t patience)
+{
+  co_await Timeout{patience};
+  throw std::runtime_error("had enough");
+}
+
+} // namespace
+
+TEST_CASE("coroutine machines", "[libsim][coroutine]")
+{
+  static_assert(has_resume<CoMachine>::value);
+  static_assert(!has_resume<Master>::value);
+
+  FramePool pool;
+
+  // the classic master or the coroutine one, against a coroutine receiver
+  auto run = [&](uint8_t value, bool coro_master, uint64_t half_period) {
+    Wires                     w;
+    Received                  got;
+    std::function<uint64_t()> clock;
+
+    Master m;
+    m.w           = &w;
+    m.value       = value;
+    m.half_period = half_period;
+    auto cm = master(pool, &w, value, half_period);
+    auto r  = receiver(pool, &w, &got, &clock);
+
+    if (coro_master) {
+      auto sim = SimBuilder<>().add(cm).add(r).time_skipping().get_sim();
+      clock    = [&] { return sim.now(); };
+      sim.run_until_quiescent();
+      REQUIRE(cm.done());
+    }
+    else {
+      auto sim = SimBuilder<>().add(m).add(r).time_skipping().get_sim();
+      clock    = [&] { return sim.now(); };
+      sim.run_until_quiescent();
+      REQUIRE(!cm.done()); // never got started
+    }
+
+    REQUIRE(w.ssel == 1);
+    REQUIRE(r.done());
+    REQUIRE(std::holds_alternative<CoMachine::Finished>(r.currentState()));
+    return got;
+  };
+
+  for (unsigned v = 0; v < 256; v += 5) {
+    INFO("value " << v);
+
+    auto classic = run(v, false, 10);
+    REQUIRE(classic.done);
+    REQUIRE(classic.value == v);
+    REQUIRE(classic.edges.size() == 8);
+    REQUIRE(classic.edges[0] == 11); // seen the tick after it went up
+    REQUIRE(classic.edges[7] == 151);
+
+    auto coro = run(v, true, 10);
+    REQUIRE(coro.value == v);
+    REQUIRE(coro.edges == classic.edges);
+  }
+
+  // the receiver gives up on a master that's way too slow
+  auto slow = run(0xff, true, 150);
+  REQUIRE(slow.timed_out);
+  REQUIRE(!slow.done);
+  REQUIRE(slow.edges.empty());
+
+  // Every frame went back, and they all fit in the first chunk
+  REQUIRE(pool.live() == 0);
+  REQUIRE(pool.chunks() == 1);
+
+  {
+    auto g   = grumpy(pool, 20);
+    auto sim = SimBuilder<>().add(g).get_sim();
+    REQUIRE(pool.live() == 1);
+    REQUIRE_THROWS_WITH(sim.run_for(100), "had enough");
+    REQUIRE(g.done());
+    REQUIRE(sim.now() == 20);
+  }
+  REQUIRE(pool.live() == 0);
+}
@@ -0,0 +1,269 @@
+#include "../../catch/catch.hpp"
+
+#include "../Federation.h"
+
+#include <functional>
+
+using namespace libsim;
+
+namespace {
+
+using Trace = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Writes `value` after `delay` ticks, once
+struct Writer {
+  MAKE_STATE(Waiting);
+  MAKE_STATE(Done);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Waiting{};
+    return Only{Timeout{delay}};
+  }
+
+  Events transition(Waiting, Timeout) {
+    state = Done{};
+    value = 1;
+    return None{};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Waiting, Done> state = Uninitialized{};
+  uint64_t              delay = 10;
+  uint8_t               value = 0;
+};
+
+// Writes down when `in` went up
+struct Watcher {
+  MAKE_STATE(Watching);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Watching{};
+    return Only{RisingEdge{in}};
+  }
+
+  Events transition(Watching, RisingEdge) {
+    seen.push_back(clock());
+    return None{};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Watching>          state = Uninitialized{};
+  uint8_t const*            in    = nullptr;
+  std::function<uint64_t()> clock;
+  std::vector<uint64_t>     seen;
+};
+
+// Waits for `in` to flip, thinks about it for a bit and flips `out`
+struct Player {
+  MAKE_STATE(Waiting);
+  MAKE_STATE(Thinking);
+
+  Events transition(Uninitialized, InitEvent) {
+    if (serve) return think();
+    return wait();
+  }
+
+  Events transition(Waiting, RisingEdge)  { return hit(1); }
+  Events transition(Waiting, FallingEdge) { return hit(0); }
+
+  Events transition(Thinking, Timeout) {
+    out ^= 1;
+    return wait();
+  }
+
+  Events hit(uint64_t level) {
+    trace.emplace_back(clock(), level);
+    return think();
+  }
+
+  Events think() {
+    state = Thinking{};
+    return Only{Timeout{delay + trace.size() % 3}};
+  }
+
+  Events wait() {
+    state = Waiting{};
+    return OneOf{RisingEdge{in}, FallingEdge{in}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Waiting, Thinking> state = Uninitialized{};
+  bool                      serve = false;
+  uint64_t                  delay = 4;
+  uint8_t const*            in    = nullptr;
+  uint8_t                   out   = 0;
+  std::function<uint64_t()> clock;
+  Trace                     trace;
+};
+
+// Flips `out` every `period` ticks, forever
+struct Blinker {
+  MAKE_STATE(Blinking);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Blinking{};
+    return Only{Timeout{period}};
+  }
+
+  Events transition(Blinking, Timeout) {
+    out ^= 1;
+    return Only{Timeout{period}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Blinking> state  = Uninitialized{};
+  uint64_t         period = 7;
+  uint8_t          out    = 0;
+};
+
+} // namespace
+
+TEST_CASE("links are exactly latency ticks late", "[libsim][federation]")
+{
+  // everything in one simulator, for reference
+  uint64_t together;
+  {
+    Writer  w;
+    Watcher v;
+    v.in = &w.value;
+
+    auto sim = SimBuilder<>().add(w).add(v).get_sim();
+    v.clock  = [&] { return sim.now(); };
+    sim.run_for(100);
+
+    REQUIRE(v.seen.size() == 1);
+    together = v.seen[0];
+  }
+
+  for (bool optimistic : {false, true}) {
+    for (bool skipping : {false, true}) {
+      for (uint64_t latency : {1, 5, 40}) {
+        INFO("latency " << latency << (skipping ? ", skipping" : "")
+                        << (optimistic ? ", optimistic" : ""));
+
+        Writer  w;
+        Watcher v;
+        uint8_t in = 0;
+        v.in = &in;
+
+        auto a = SimBuilder<>().add(w).time_skipping(skipping).get_sim();
+        auto b = SimBuilder<>().add(v).time_skipping(skipping).get_sim();
+        v.clock = [&] { return b.now(); };
+
+        Federation f({optimistic});
+        size_t     ia = f.add(a);
+        size_t     ib = f.add(b);
+        f.link(ia, &w.value, ib, &in, latency);
+
+        auto stats = f.run_for(100);
+        REQUIRE(stats.ticks == 100);
+        REQUIRE(stats.events == 2);
+        REQUIRE(a.now() == 100);
+        REQUIRE(b.now() == 100);
+
+        REQUIRE(v.seen.size() == 1);
+        REQUIRE(v.seen[0] == w.delay + latency);
+        if (latency == 1) REQUIRE(v.seen[0] == together);
+      }
+    }
+  }
+
+  Federation f;
+  int        x = 0, y = 0;
+  REQUIRE_THROWS_AS(f.link(0, &x, 1, &y, 1), std::logic_error);
+}
+
+TEST_CASE("federation runs the same on threads", "[libsim][federation]")
+{
+  // Two players knocking a value back and forth over a slow link, and a third
+  // partition that blinks at the first one over a really slow one. Nobody
+  // waits on anybody for longer than they have to (or at all, optimistically),
+  // but the outcome has to be the same as running them all round robin on one
+  // thread.
+  struct Result {
+    uint64_t              events;
+    Trace                 alice, bob;
+    std::vector<uint64_t> blinks;
+    uint64_t              rollbacks;
+
+    bool operator==(Result const& o) const {
+      return std::tie(events, alice, bob, blinks) ==
+             std::tie(o.events, o.alice, o.bob, o.blinks);
+    }
+  };
+
+  auto run = [](FederationOptions opts, bool threaded, bool skipping) {
+    Player  alice, bob;
+    Blinker blinker;
+    Watcher blinks;
+    uint8_t alice_in = 0, bob_in = 0, blink_in = 0;
+
+    alice.serve = true;
+    alice.in    = &alice_in;
+    bob.in      = &bob_in;
+    bob.delay   = 6;
+    blinks.in   = &blink_in;
+
+    auto a = SimBuilder<>().add(alice).add(blinks).time_skipping(skipping).get_sim();
+    auto b = SimBuilder<>().add(bob).time_skipping(skipping).get_sim();
+    auto c = SimBuilder<>().add(blinker).time_skipping(skipping).get_sim();
+    alice.clock  = [&] { return a.now(); };
+    blinks.clock = [&] { return a.now(); };
+    bob.clock    = [&] { return b.now(); };
+
+    Federation f(opts);
+    size_t     ia = f.add(a);
+    size_t     ib = f.add(b);
+    size_t     ic = f.add(c);
+    f.link(ia, &alice.out, ib, &bob_in, 3);
+    f.link(ib, &bob.out, ia, &alice_in, 2);
+    f.link(ic, &blinker.out, ia, &blink_in, 50);
+
+    // in a few pieces, to make sure picking back up works
+    uint64_t events = 0;
+    for (int i = 0; i < 4; ++i) events += f.run_for(2500, threaded).events;
+    REQUIRE(a.now() == 10000);
+    REQUIRE(c.now() == 10000);
+
+    return Result{events, alice.trace, bob.trace, blinks.seen, f.rollbacks()};
+  };
+
+  FederationOptions optimistic;
+  optimistic.optimistic = true;
+
+  // small enough that the window and the fossil collection both get a workout
+  FederationOptions tight = optimistic;
+  tight.window     = 20;
+  tight.save_every = 3;
+
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    auto serial = run({}, false, skipping);
+    REQUIRE(serial.alice.size() > 500);
+    REQUIRE(serial.bob.size() > 500);
+    REQUIRE(serial.blinks.size() == 1);
+
+    // a serve takes 4-6 ticks to think about plus 3 to get there
+    REQUIRE(serial.bob[0] == Trace::value_type{4 + 3, 1});
+    REQUIRE(serial.blinks[0] == 7 + 50);
+
+    for (int i = 0; i < 3; ++i) REQUIRE(run({}, true, skipping) == serial);
+
+    // Round robin keeps everyone in lockstep, except that skipping lets an
+    // idle player jump a whole window ahead and get sent back
+    auto warped = run(optimistic, false, skipping);
+    REQUIRE(warped == serial);
+    if (skipping) REQUIRE(warped.rollbacks > 100);
+
+    REQUIRE(run(tight, false, skipping) == serial);
+    for (int i = 0; i < 3; ++i) {
+      REQUIRE(run(optimistic, true, skipping) == serial);
+      REQUIRE(run(tight, true, skipping) == serial);
+    }
+  }
+}
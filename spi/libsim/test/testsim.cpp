@@ -1,7 +1,11 @@
 #include "../../catch/catch.hpp"
 
 #include "../Simulator.h" // don't look in here
+#include "../Sweep.h"
 
+#include <algorithm>
+#include <sstream>
+#include <tuple>
 #include <unordered_set>
 
 using namespace libsim;
@@ -239,3 +243,1374 @@ TEST_CASE("user id", "[libsim]")
   while (sim.poll()) { } // must eventually stop, will throw if we trigger twice
   REQUIRE(m.wasTriggered());
 }
+
+TEST_CASE("timers fire in deadline order", "[libsim]")
+{
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return AllOf{Timeout{300, 3}, Timeout{100, 1}, Timeout{200, 2}, Timeout{100, 4}};
+    }
+
+    Events transition(Waiting, Timeout t) {
+      order.push_back(t.user_id);
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting>       state = Uninitialized{};
+    std::vector<uint64_t> order;
+  };
+
+  MyMachine m;
+  auto sim = SimBuilder<>().add(m).get_sim();
+
+  // nothing is due until tick 100
+  for (size_t i = 0; i < 100; ++i) REQUIRE(sim.poll());
+  REQUIRE(m.order.empty());
+
+  while (sim.poll()) { }
+  REQUIRE(m.order == std::vector<uint64_t>{1, 4, 2, 3});
+}
+
+TEST_CASE("time skipping", "[libsim]")
+{
+  // One machine raises a flag after a while, the other waits for the flag and
+  // then waits some more
+  struct Raiser {
+    MAKE_STATE(Waiting);
+    MAKE_STATE(Raised);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return Only{Timeout{500}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      state = Raised{};
+      flag  = true;
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting, Raised> state = Uninitialized{};
+    bool                    flag  = false;
+  };
+
+  struct Watcher {
+    MAKE_STATE(Watching);
+    MAKE_STATE(Sleeping);
+    MAKE_STATE(Done);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Watching{};
+      return Only{RisingEdge{flag}};
+    }
+
+    Events transition(Watching, RisingEdge) {
+      state = Sleeping{};
+      return Only{Timeout{1000}};
+    }
+
+    Events transition(Sleeping, Timeout) {
+      state = Done{};
+      return None{};
+    }
+
+    bool isDone() const { return std::holds_alternative<Done>(state); }
+    auto currentState() const { return state; }
+
+    States<Watching, Sleeping, Done> state = Uninitialized{};
+    bool const*                      flag;
+  };
+
+  auto run = [](bool skipping) {
+    Raiser  r;
+    Watcher w;
+    w.flag = &r.flag;
+
+    auto sim = SimBuilder<>().add(r).add(w).time_skipping(skipping).get_sim();
+
+    size_t polls = 0;
+    while (sim.poll()) polls += 1;
+
+    REQUIRE(w.isDone());
+    return std::make_pair(polls, sim.now());
+  };
+
+  auto [slow_polls, slow_now] = run(false);
+  auto [fast_polls, fast_now] = run(true);
+
+  // same answer, a lot less work
+  REQUIRE(slow_now == fast_now);
+  REQUIRE(slow_polls > 1000);
+  REQUIRE(fast_polls < 10);
+}
+
+TEST_CASE("timing wheel matches heap", "[libsim]")
+{
+  // Lots of timers at all sorts of distances (so every level of the wheel gets
+  // used), some of them canceled through OneOf. Both backends have to fire the
+  // same things at the same times
+  struct MyMachine {
+    MAKE_STATE(Running);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Running{};
+
+      AllOf all;
+      uint64_t x = 12345;
+      for (uint64_t i = 0; i < 2000; ++i) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        all.events.push_back(Timeout{(x >> 33) % (1ull << (i % 24)), i});
+      }
+      return all;
+    }
+
+    Events transition(Running, Timeout t) {
+      fired.emplace_back(clock(), t.user_id);
+      if (t.user_id % 7 == 0 && rearms < 500) {
+        rearms += 1;
+        return OneOf{Timeout{t.user_id % 100, t.user_id}, Timeout{t.user_id, 1000000}};
+      }
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Running>                            state = Uninitialized{};
+    std::function<uint64_t()>                  clock;
+    size_t                                     rearms = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> fired;
+  };
+
+  auto run = [](TimerBackend backend, bool skipping) {
+    MyMachine m;
+    auto sim = SimBuilder<>().add(m).timers(backend).time_skipping(skipping).get_sim();
+    m.clock  = [&] { return sim.now(); };
+    while (sim.poll()) { }
+    return m.fired;
+  };
+
+  auto heap  = run(TimerBackend::Heap,  true);
+  auto wheel = run(TimerBackend::Wheel, true);
+  REQUIRE(heap.size() == 2500);
+  REQUIRE(heap == wheel);
+
+  // and the wheel has to get the same answer when stepping one tick at a time
+  REQUIRE(run(TimerBackend::Wheel, false) == heap);
+
+  // same for the scanner
+  REQUIRE(run(TimerBackend::Scan, true)  == heap);
+  REQUIRE(run(TimerBackend::Scan, false) == heap);
+}
+
+TEST_CASE("byte diff kernels agree", "[libsim]")
+{
+  std::vector<std::pair<char const*, diff::Kernel>> kernels{{"scalar", diff::scalar}};
+#ifdef LIBSIM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) kernels.emplace_back("sse2", diff::sse2);
+  if (__builtin_cpu_supports("avx2")) kernels.emplace_back("avx2", diff::avx2);
+#endif
+
+  uint64_t x = 4242;
+  auto rand = [&] { return x = x * 6364136223846793005ull + 1442695040888963407ull; };
+
+  for (size_t n : {0, 32, 64, 320}) {
+    for (unsigned odds : {0, 1, 8, 64}) { // 1 in odds bytes change, 0 = none
+      std::vector<uint8_t> a(n), b(n);
+      std::vector<uint32_t> want;
+      for (size_t i = 0; i < n; ++i) {
+        a[i] = b[i] = rand() >> 56;
+        if (odds && rand() % odds == 0) {
+          b[i] ^= 1 << (rand() % 8);
+          want.push_back(i);
+        }
+      }
+
+      for (auto [name, kernel] : kernels) {
+        INFO(name << " n=" << n << " odds=" << odds);
+        std::vector<uint32_t> got(n);
+        got.resize(kernel(a.data(), b.data(), n, got.data()));
+        REQUIRE(got == want);
+      }
+    }
+  }
+}
+
+TEST_CASE("lots of byte watchers", "[libsim]")
+{
+  // one watcher per value, spread over more than one chunk of packed bytes
+  struct Crowd {
+    MAKE_STATE(Watching);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Watching{};
+      AllOf all;
+      for (size_t i = 0; i < values.size(); ++i) {
+        all.events.push_back(RisingEdge{&values[i], i});
+      }
+      return all;
+    }
+
+    Events transition(Watching, RisingEdge e) {
+      seen.push_back(e.user_id);
+      return Only{RisingEdge{&values[e.user_id], e.user_id}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Watching>     state  = Uninitialized{};
+    std::vector<uint8_t> values = std::vector<uint8_t>(100, 0);
+    std::vector<size_t>  seen;
+  };
+
+  Crowd c;
+  auto sim = SimBuilder<>().add(c).get_sim();
+  sim.run_for(5);
+
+  c.values[0] = c.values[31] = c.values[32] = c.values[99] = 1;
+  sim.run_for(2);
+  REQUIRE(c.seen == std::vector<size_t>{0, 31, 32, 99});
+
+  // not a rising edge, 1 -> 2 is still Hi
+  c.values[31] = 2;
+  sim.run_for(2);
+  REQUIRE(c.seen.size() == 4);
+
+  c.values[31] = 0;
+  c.values[50] = 7;
+  sim.run_for(2);
+  REQUIRE(c.seen == std::vector<size_t>{0, 31, 32, 99, 50});
+}
+
+TEST_CASE("deadline scan kernels agree", "[libsim]")
+{
+  std::vector<std::pair<char const*, scan::Kernel>> kernels{{"scalar", scan::scalar}};
+#ifdef LIBSIM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) kernels.emplace_back("sse4.2", scan::sse42);
+  if (__builtin_cpu_supports("avx2"))   kernels.emplace_back("avx2",   scan::avx2);
+#endif
+
+  uint64_t x = 777;
+  auto rand = [&] { return x = x * 6364136223846793005ull + 1442695040888963407ull; };
+
+  // odd lengths for the scalar tails, and values on both sides of the sign bit
+  // since the vector versions have to fake unsigned compares
+  for (size_t n : {0, 1, 2, 3, 4, 5, 7, 8, 9, 31, 100}) {
+    std::vector<uint64_t> deadlines(n);
+    for (auto& d : deadlines) {
+      d = rand();
+      if (d & 1) d >>= 60;
+    }
+
+    for (uint64_t now : {0ull, 5ull, 1ull << 62, 1ull << 63, ~0ull - 1, ~0ull}) {
+      std::vector<uint32_t> want(n), got(n);
+      uint64_t              want_next, got_next;
+      size_t want_n = scan::scalar(deadlines.data(), n, now, want.data(), want_next);
+
+      for (auto [name, kernel] : kernels) {
+        INFO(name << " n=" << n << " now=" << now);
+        size_t got_n = kernel(deadlines.data(), n, now, got.data(), got_next);
+        REQUIRE(got_n == want_n);
+        REQUIRE(std::equal(want.begin(), want.begin() + want_n, got.begin()));
+        REQUIRE(got_next == want_next);
+      }
+    }
+  }
+}
+
+TEST_CASE("timing wheel far timeout", "[libsim]")
+{
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+    MAKE_STATE(Triggered);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return OneOf{Timeout{1ull << 40}, Timeout{1ull << 50}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      state = Triggered{};
+      return None{};
+    }
+
+    bool wasTriggered() const { return std::holds_alternative<Triggered>(state); }
+    auto currentState() const { return state; }
+
+    States<Waiting, Triggered> state = Uninitialized{};
+  };
+
+  MyMachine m;
+  auto sim = SimBuilder<>().add(m).timers(TimerBackend::Wheel).time_skipping().get_sim();
+
+  size_t polls = 0;
+  while (sim.poll()) polls += 1;
+
+  REQUIRE(m.wasTriggered());
+  REQUIRE(sim.now() == (1ull << 40) + 1);
+  REQUIRE(polls < 5);
+}
+
+TEST_CASE("idle watchers aren't evaluated", "[libsim]")
+{
+  static size_t evals = 0;
+  auto counting = [](void const* ptr) {
+    evals += 1;
+    return *static_cast<bool const*>(ptr) ? HiLow::Hi : HiLow::Low;
+  };
+
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      AllOf all;
+      for (size_t i = 0; i < 100; ++i) all.events.push_back(RisingEdge{that, 0, eval});
+      return all;
+    }
+
+    Events transition(Waiting, RisingEdge) {
+      fired += 1;
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting> state = Uninitialized{};
+    bool const*     that;
+    Evaluator       eval;
+    size_t          fired = 0;
+  };
+
+  bool      value = false;
+  MyMachine m;
+  m.that = &value;
+  m.eval = counting;
+
+  auto sim = SimBuilder<>().add(m).get_sim();
+  REQUIRE(sim.poll()); // new watchers get one look
+
+  size_t before = evals;
+  for (size_t i = 0; i < 1000; ++i) REQUIRE(sim.poll());
+  REQUIRE(evals == before);
+
+  value = true;
+  REQUIRE(sim.poll());
+  REQUIRE(m.fired == 100);
+  REQUIRE(!sim.poll());
+}
+
+TEST_CASE("OneOf cancels siblings right away", "[libsim]")
+{
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+    MAKE_STATE(Triggered);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      // both timeouts are due on the same tick, only one of them gets to fire
+      return OneOf{RisingEdge{that}, Timeout{10}, Timeout{10}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      state = Triggered{};
+      return None{};
+    }
+
+    bool wasTriggered() const { return std::holds_alternative<Triggered>(state); }
+    auto currentState() const { return state; }
+
+    States<Waiting, Triggered> state = Uninitialized{};
+    bool const*                that;
+  };
+
+  bool      never = false;
+  MyMachine m;
+  m.that = &never;
+
+  for (TimerBackend backend : {TimerBackend::Heap, TimerBackend::Wheel}) {
+    m.state  = Uninitialized{};
+    auto sim = SimBuilder<>().add(m).timers(backend).get_sim();
+
+    for (size_t i = 0; i < 11; ++i) REQUIRE(sim.poll());
+    REQUIRE(m.wasTriggered());
+    REQUIRE(!sim.poll()); // the edge went away with the timeouts
+  }
+}
+
+TEST_CASE("same machine type twice", "[libsim]")
+{
+  // machines are told apart by where they were added, not by their type
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+    MAKE_STATE(Triggered);
+
+    MyMachine(uint64_t duration) : duration(duration) { }
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return OneOf{Timeout{duration}, Timeout{duration + 1}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      state = Triggered{};
+      return None{};
+    }
+
+    bool wasTriggered() const { return std::holds_alternative<Triggered>(state); }
+    auto currentState() const { return state; }
+
+    uint64_t                   duration;
+    States<Waiting, Triggered> state = Uninitialized{};
+  };
+
+  MyMachine a(10);
+  MyMachine b(20);
+  auto sim = SimBuilder<>().add(a).add(b).get_sim();
+
+  for (size_t i = 0; i <= 10; ++i) sim.poll();
+  REQUIRE(a.wasTriggered());
+  REQUIRE(!b.wasTriggered());
+
+  while (sim.poll()) { } // will throw if either one triggers twice
+  REQUIRE(b.wasTriggered());
+}
+
+TEST_CASE("wide and custom edges", "[libsim]")
+{
+  struct Thing {
+    int      a;
+    uint32_t b;
+  };
+
+  struct MyMachine {
+    MAKE_STATE(Waiting);
+    MAKE_STATE(Triggered);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+
+      // Hi when b is odd
+      auto odd = [](void const* ptr) {
+        if (static_cast<Thing const*>(ptr)->b & 1) return HiLow::Hi;
+        else                                       return HiLow::Low;
+      };
+
+      return AllOf{
+        RisingEdge{wide, 1},
+        FallingEdge{wide, 2},
+        RisingEdge{thing, 3, odd},
+      };
+    }
+
+    Events transition(Waiting, RisingEdge e) {
+      seen.push_back(e.user_id);
+      return None{};
+    }
+
+    Events transition(Waiting, FallingEdge e) {
+      seen.push_back(e.user_id);
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting, Triggered> state = Uninitialized{};
+    uint64_t const*            wide;
+    Thing const*               thing;
+    std::vector<uint64_t>      seen;
+  };
+
+  uint64_t  wide  = 0;
+  Thing     thing = {0, 2};
+  MyMachine m;
+  m.wide  = &wide;
+  m.thing = &thing;
+
+  auto sim = SimBuilder<>().add(m).get_sim();
+  REQUIRE(sim.poll());
+
+  wide = 1ull << 40; // only the high half is set
+  REQUIRE(sim.poll());
+  REQUIRE(m.seen == std::vector<uint64_t>{1});
+
+  thing.b = 3;
+  REQUIRE(sim.poll());
+  REQUIRE(m.seen == std::vector<uint64_t>{1, 3});
+
+  wide = 0;
+  REQUIRE(sim.poll());
+  REQUIRE(m.seen == std::vector<uint64_t>{1, 3, 2});
+  REQUIRE(!sim.poll());
+
+  // no idea what Hi means for a Thing
+  REQUIRE_THROWS(RisingEdge{&thing});
+}
+
+TEST_CASE("level, value and change events", "[libsim]")
+{
+  // arms everything at once, writes down what went off when
+  struct Watcher {
+    MAKE_STATE(Watching);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Watching{};
+      return std::move(arm);
+    }
+
+    Events transition(Watching, Level e)     { return hit(e.user_id); }
+    Events transition(Watching, Equals e)    { return hit(e.user_id); }
+    Events transition(Watching, MaskMatch e) { return hit(e.user_id); }
+    Events transition(Watching, Changed e)   { return hit(e.user_id); }
+
+    Events hit(uint64_t id) {
+      seen.emplace_back(clock(), id);
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Watching>                           state = Uninitialized{};
+    Events                                     arm;
+    std::function<uint64_t()>                  clock;
+    std::vector<std::pair<uint64_t, uint64_t>> seen;
+  };
+
+  using Seen = std::vector<std::pair<uint64_t, uint64_t>>;
+
+  // CData, SData, IData, QData and a 96 bit WData
+  uint8_t  c    = 0;
+  uint16_t s    = 0;
+  uint32_t i    = 0;
+  uint64_t q    = 5;
+  uint32_t w[3] = {0, 0, 0};
+
+  Watcher m;
+  m.arm = AllOf{
+    Level{&c, 1},
+    Equals{&s, 0x1234, 2},
+    MaskMatch{&i, 0xf0, 0x30, 3},
+    Changed{&q, 4},
+    Level{&w, 5},
+    Equals{&w, 7, 6},
+    Changed{&w, 7},
+    Equals{&c, 0, 8}, // already true
+    MaskMatch{&w, 1ull << 63, 1ull << 63, 9},
+  };
+
+  auto sim = SimBuilder<>().add(m).get_sim();
+  m.clock  = [&] { return sim.now(); };
+
+  auto step = [&](auto write) {
+    write();
+    sim.poll();
+    return sim.now() - 1;
+  };
+
+  Seen expected;
+  REQUIRE(sim.poll());
+  expected.emplace_back(0, 8);
+  REQUIRE(m.seen == expected);
+
+  step([&] { s = 0x1233; q = 5; i = 0x0f; });
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { s = 0x1234; }), 2);
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { i = 0x12345637; }), 3);
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { q = 1ull << 63; }), 4);
+  REQUIRE(m.seen == expected);
+
+  // only the top word, so it's not 7 but it did change
+  uint64_t t = step([&] { w[2] = 1; });
+  expected.emplace_back(t, 5);
+  expected.emplace_back(t, 7);
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { w[2] = 0; w[0] = 7; }), 6);
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { w[1] = 0x80000000; }), 9);
+  REQUIRE(m.seen == expected);
+
+  expected.emplace_back(step([&] { c = 1; }), 1);
+  REQUIRE(m.seen == expected);
+  REQUIRE(!sim.poll());
+}
+
+TEST_CASE("value events don't wake anybody up", "[libsim]")
+{
+  // counts up every tick, like a verilated counter would
+  struct Counter {
+    MAKE_STATE(Counting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Counting{};
+      return Only{Timeout{1}};
+    }
+
+    Events transition(Counting, Timeout) {
+      count += 1;
+      return Only{Timeout{1}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Counting> state = Uninitialized{};
+    uint16_t         count = 0;
+  };
+
+  // waits for the counter to hit a number, then for the next multiple of 64
+  struct Waiter {
+    MAKE_STATE(WaitingForIt);
+    MAKE_STATE(WaitingForRound);
+    MAKE_STATE(Done);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = WaitingForIt{};
+      return OneOf{Equals{count, 1000}, Timeout{5000}};
+    }
+
+    Events transition(WaitingForIt, Equals) {
+      at.push_back(clock());
+      state = WaitingForRound{};
+      return Only{MaskMatch{count, 63, 0}};
+    }
+
+    Events transition(WaitingForRound, MaskMatch) {
+      at.push_back(clock());
+      state = Done{};
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<WaitingForIt, WaitingForRound, Done> state = Uninitialized{};
+    uint16_t const*                             count;
+    std::function<uint64_t()>                   clock;
+    std::vector<uint64_t>                       at;
+  };
+
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    Counter c;
+    Waiter  w;
+    w.count = &c.count;
+
+    auto sim = SimBuilder<>().add(c).add(w).time_skipping(skipping).get_sim();
+    w.clock  = [&] { return sim.now(); };
+
+    auto stats = sim.run_for(2000);
+
+    // 1000 is written on tick 1000 and seen on the next one, 1024 likewise
+    REQUIRE(w.at == std::vector<uint64_t>{1001, 1025});
+    REQUIRE(stats.events == 1999 + 2);
+  }
+}
+
+TEST_CASE("clock sources", "[libsim]")
+{
+  // pretend verilated model, counts rising edges of clk
+  struct Model {
+    uint8_t               clk   = 0;
+    uint8_t               last  = 0;
+    uint16_t              count = 0;
+    std::vector<uint64_t> edges;
+
+    void eval() {
+      if (clk && !last) count += 1;
+      last = clk;
+    }
+  };
+
+  // writes down when clk went up, and calls it a day after 10 of them
+  struct Watcher {
+    MAKE_STATE(Watching);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Watching{};
+      return OneOf{RisingEdge{clk}, Equals{count, 10}};
+    }
+
+    Events transition(Watching, RisingEdge) {
+      seen.push_back(clock());
+      return OneOf{RisingEdge{clk}, Equals{count, 10}};
+    }
+
+    Events transition(Watching, Equals) {
+      seen.push_back(clock());
+      done = true;
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Watching>          state = Uninitialized{};
+    uint8_t const*            clk;
+    uint16_t const*           count;
+    bool                      done  = false;
+    std::function<uint64_t()> clock;
+    std::vector<uint64_t>     seen;
+  };
+
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    Model   m;
+    Watcher w;
+    w.clk   = &m.clk;
+    w.count = &m.count;
+
+    ClockSource c;
+    c.signal      = &m.clk;
+    c.half_period = 3;
+    c.phase       = 1;
+    c.ctx         = &m;
+    c.stop        = &w.done;
+    c.on_edge     = [](void* ctx, uint64_t tick) {
+      auto* model = static_cast<Model*>(ctx);
+      model->eval();
+      model->edges.push_back(tick);
+    };
+
+    auto sim = SimBuilder<>().add(w).clock(c).time_skipping(skipping).get_sim();
+    w.clock  = [&] { return sim.now(); };
+
+    auto stats = sim.run_until_quiescent(1000);
+
+    // Up on ticks 1, 7, 13... and seen on the next one. The 10th one beats
+    // Equals to it, which goes off on the tick after. The edge after that
+    // (tick 58) never happens
+    std::vector<uint64_t> expected;
+    for (uint64_t t = 2; t <= 56; t += 6) expected.push_back(t);
+    expected.push_back(57);
+
+    REQUIRE(w.seen == expected);
+    REQUIRE(m.count == 10);
+    REQUIRE(m.edges.size() == 19);
+    REQUIRE(m.edges.back() == 55);
+    REQUIRE(stats.events == 11);
+    REQUIRE(sim.now() == 59);
+    REQUIRE(!sim.poll());
+  }
+
+  ClockSource broken;
+  broken.half_period = 0;
+  REQUIRE_THROWS_AS(SimBuilder<>().clock(broken).get_sim(), std::logic_error);
+}
+
+TEST_CASE("clock domains", "[libsim]")
+{
+  // pretend verilated model with two clock inputs, writes down every eval
+  struct Model {
+    uint8_t fast = 0;
+    uint8_t slow = 0;
+
+    std::vector<std::tuple<uint64_t, uint8_t, uint8_t>> evals; // (tick, fast, slow)
+  };
+
+  auto eval = [](void* ctx, uint64_t tick) {
+    auto* m = static_cast<Model*>(ctx);
+    m->evals.emplace_back(tick, m->fast, m->slow);
+  };
+
+  Model m;
+  Model other;
+
+  // every 3 ticks from 0
+  ClockSource fast;
+  fast.signal      = &m.fast;
+  fast.half_period = 3;
+  fast.ctx         = &m;
+  fast.on_edge     = eval;
+
+  // every 2.5 ticks from 0.5, so 0, 3, 5, 8, 10, 13...
+  ClockSource slow;
+  slow.signal      = &m.slow;
+  slow.half_period = 5;
+  slow.phase       = 1;
+  slow.divisor     = 2;
+  slow.ctx         = &m;
+  slow.on_edge     = eval;
+
+  // same edges as fast but a different model, doesn't get merged with it
+  ClockSource apart = fast;
+  apart.signal      = nullptr;
+  apart.ctx         = &other;
+
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    m.fast = m.slow = 0;
+    m.evals.clear();
+    other.evals.clear();
+
+    auto sim = SimBuilder<>().clock(fast).clock(slow).clock(apart)
+      .time_skipping(skipping)
+      .get_sim();
+    sim.run_for(16);
+
+    // both flip before the eval on ticks 0, 3 and 15
+    std::vector<std::tuple<uint64_t, uint8_t, uint8_t>> expected = {
+      {0, 1, 1}, {3, 0, 0}, {5, 0, 1}, {6, 1, 1}, {8, 1, 0}, {9, 0, 0},
+      {10, 0, 1}, {12, 1, 1}, {13, 1, 0}, {15, 0, 1},
+    };
+    REQUIRE(m.evals == expected);
+    REQUIRE(other.evals.size() == 6);
+  }
+
+  ClockSource too_fast;
+  too_fast.half_period = 2;
+  too_fast.divisor     = 3;
+  REQUIRE_THROWS_AS(SimBuilder<>().clock(too_fast).get_sim(), std::logic_error);
+
+  too_fast.divisor = 0;
+  REQUIRE_THROWS_AS(SimBuilder<>().clock(too_fast).get_sim(), std::logic_error);
+}
+
+TEST_CASE("run_for, run_until and run_until_quiescent", "[libsim]")
+{
+  // ticks a few times and then waits around for an edge that never comes
+  struct Pinger {
+    MAKE_STATE(Pinging);
+    MAKE_STATE(Waiting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state        = Pinging{};
+      transitions += 1;
+      return Only{Timeout{10}};
+    }
+
+    Events transition(Pinging, Timeout) {
+      pings       += 1;
+      transitions += 1;
+      if (pings < 5) return Only{Timeout{10}};
+
+      state = Waiting{};
+      return Only{RisingEdge{&never}};
+    }
+
+    Events transition(Waiting, RisingEdge) {
+      throw std::logic_error("who touched it?");
+    }
+
+    auto currentState() const { return state; }
+
+    States<Pinging, Waiting> state       = Uninitialized{};
+    size_t                   pings       = 0;
+    uint64_t                 transitions = 0;
+    bool                     never       = false;
+  };
+
+  for (bool skipping : {false, true}) {
+    Pinger p;
+    auto   sim = SimBuilder<>().add(p).time_skipping(skipping).get_sim();
+
+    auto first = sim.run_for(25);
+    REQUIRE(first.ticks == 25);
+    REQUIRE(sim.now() == 25);
+    REQUIRE(p.pings == 2);
+
+    auto second = sim.run_until([&] { return p.pings == 4; });
+    REQUIRE(p.pings == 4);
+    REQUIRE(second.ticks == sim.now() - 25);
+
+    // without skipping the watcher keeps things going until we give up
+    auto third = sim.run_until_quiescent(1000);
+    REQUIRE(p.pings == 5);
+    if (skipping) REQUIRE(third.ticks < 1000);
+    else          REQUIRE(third.ticks == 1000);
+
+    // init already happened in get_sim()
+    REQUIRE(first.events + second.events + third.events == p.transitions - 1);
+
+    // time still goes by when there's nothing to do
+    REQUIRE(sim.run_for(1'000'000).ticks == 1'000'000);
+    REQUIRE(p.transitions == 6);
+  }
+}
+
+TEST_CASE("transition table", "[libsim]")
+{
+  struct Half {
+    MAKE_STATE(Waiting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return Only{Timeout{1}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      return Only{RisingEdge{&value}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting> state = Uninitialized{};
+    bool            value = false;
+  };
+
+  // all of this is known before anything runs
+  using T = Transitions<Half>;
+  static_assert(T::states == 2);
+  static_assert(T::defined(0, 0));  // Uninitialized, InitEvent
+  static_assert(T::defined(1, 1));  // Waiting, Timeout
+  static_assert(!T::defined(1, 2)); // Waiting, RisingEdge
+  static_assert(T::missing == T::states * T::events - 2);
+
+  Half h;
+  auto sim = SimBuilder<>().add(h).get_sim();
+  sim.run_for(3);
+
+  h.value = true;
+  REQUIRE_THROWS_AS(sim.run_for(2), std::runtime_error);
+}
+
+TEST_CASE("threads don't change anything", "[libsim]")
+{
+  // A few teams, each one its own group. Inside a team the clock toggles on
+  // odd ticks and the counter follows it on even ones. Teams only talk through
+  // `out`, which is only written on even ticks, and listened to (and re-armed
+  // on) by the next team on odd ones. So nobody reads anything another group
+  // writes in the same tick, see SimOptions::threads
+  using Trace = std::vector<std::pair<uint64_t, uint64_t>>;
+
+  struct Clock {
+    MAKE_STATE(Running);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Running{};
+      return Only{Timeout{1}};
+    }
+
+    Events transition(Running, Timeout) {
+      clk ^= 1;
+      return Only{Timeout{1}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Running> state = Uninitialized{};
+    uint8_t         clk   = 0;
+  };
+
+  struct Counter {
+    MAKE_STATE(Counting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Counting{};
+      return Only{RisingEdge{clk}};
+    }
+
+    Events transition(Counting, RisingEdge) {
+      count += 1;
+      if (count % 3 == 0) out ^= 1;
+      trace.emplace_back(clock(), count);
+      return Only{RisingEdge{clk}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Counting>          state = Uninitialized{};
+    uint8_t const*            clk;
+    uint8_t                   out   = 0;
+    uint64_t                  count = 0;
+    std::function<uint64_t()> clock;
+    Trace                     trace;
+  };
+
+  struct Listener {
+    MAKE_STATE(Listening);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Listening{};
+      return listen();
+    }
+
+    Events transition(Listening, RisingEdge) {
+      trace.emplace_back(clock(), 1);
+      return listen();
+    }
+
+    Events transition(Listening, Timeout) {
+      trace.emplace_back(clock(), 0);
+      return listen();
+    }
+
+    Events listen() { return OneOf{RisingEdge{other}, Timeout{5}}; }
+
+    auto currentState() const { return state; }
+
+    States<Listening>         state = Uninitialized{};
+    uint8_t const*            other;
+    std::function<uint64_t()> clock;
+    Trace                     trace;
+  };
+
+  struct Team {
+    Clock    clock;
+    Counter  counter;
+    Listener listener;
+  };
+
+  auto run = [](size_t threads) {
+    std::array<Team, 4> teams;
+    for (size_t g = 0; g < teams.size(); ++g) {
+      teams[g].counter.clk    = &teams[g].clock.clk;
+      teams[g].listener.other = &teams[(g + 1) % teams.size()].counter.out;
+    }
+
+    auto add = [&](auto&& b, uint32_t g) {
+      return std::move(b).add(teams[g].clock,    MachineGroup{g})
+                         .add(teams[g].counter,  MachineGroup{g})
+                         .add(teams[g].listener, MachineGroup{g});
+    };
+    auto sim = add(add(add(add(SimBuilder<>(), 0), 1), 2), 3)
+      .threads(threads).get_sim();
+
+    for (Team& t : teams) {
+      t.counter.clock  = [&] { return sim.now(); };
+      t.listener.clock = [&] { return sim.now(); };
+    }
+
+    auto stats = sim.run_for(3000);
+
+    std::vector<Trace> traces;
+    for (Team& t : teams) {
+      traces.push_back(t.counter.trace);
+      traces.push_back(t.listener.trace);
+    }
+    return std::make_pair(stats.events, traces);
+  };
+
+  auto serial = run(1);
+  REQUIRE(serial.second[0].size() > 500);
+  REQUIRE(serial.second[1].size() > 100);
+
+  for (size_t threads : {2, 4, 4}) {
+    INFO(threads << " threads");
+    REQUIRE(run(threads) == serial);
+  }
+}
+
+TEST_CASE("sweep", "[libsim]")
+{
+  // a timer that goes off after a job specific number of ticks, so some jobs
+  // take way longer than others and there's something to steal
+  struct Alarm {
+    MAKE_STATE(Waiting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Waiting{};
+      return Only{Timeout{delay}};
+    }
+
+    Events transition(Waiting, Timeout) {
+      rang = true;
+      return None{};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Waiting> state = Uninitialized{};
+    uint64_t        delay;
+    bool            rang  = false;
+  };
+
+  auto job = [](size_t i) {
+    Alarm a;
+    a.delay  = i % 7 == 0 ? 20000 : i;
+    auto sim = SimBuilder<>().add(a).get_sim();
+    auto ran = sim.run_until([&] { return a.rang; });
+    return std::make_pair(i, ran.ticks);
+  };
+
+  for (size_t threads : {1, 3, 8}) {
+    INFO(threads << " threads");
+
+    auto results = sweep(500, job, threads);
+    REQUIRE(results.size() == 500);
+    for (size_t i = 0; i < results.size(); ++i) {
+      REQUIRE(results[i].first == i);
+      REQUIRE(results[i].second == (i % 7 == 0 ? 20001 : i + 1));
+    }
+
+    // everything still runs, and the first failure is the one that comes out
+    std::vector<int> ran(100, 0);
+    auto fail = [&](size_t i) {
+      ran[i] += 1;
+      if (i % 10 == 3) throw std::runtime_error(std::to_string(i));
+    };
+    REQUIRE_THROWS_WITH(StealingPool(threads).run(100, fail), "3");
+    REQUIRE(ran == std::vector<int>(100, 1));
+  }
+
+  REQUIRE(sweep(0, job).empty());
+}
+
+TEST_CASE("checkpoint and restore", "[libsim]")
+{
+  // plain copyable machine, gets saved as a whole
+  struct Counter {
+    MAKE_STATE(Counting);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Counting{};
+      return Only{Timeout{5}};
+    }
+
+    Events transition(Counting, Timeout) {
+      log.push_back(++count);
+      return Only{Timeout{5}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Counting>      state = Uninitialized{};
+    uint64_t              count = 0;
+    std::vector<uint64_t> log;
+  };
+
+  // can't be copied, saves just what it needs
+  struct Door {
+    MAKE_STATE(Closed);
+    MAKE_STATE(Open);
+
+    using Saved = std::tuple<States<Closed, Open>, uint64_t>;
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Closed{};
+      return OneOf{RisingEdge{bell, 1}, Timeout{100, 2}};
+    }
+
+    Events transition(Closed, RisingEdge e) { return open(e.user_id); }
+    Events transition(Closed, Timeout e)    { return open(e.user_id); }
+
+    Events open(uint64_t why) {
+      state     = Open{};
+      opened_by = why;
+      *opened_at = clock();
+      return None{};
+    }
+
+    Saved checkpoint() const { return {state, opened_by}; }
+    void  restore(Saved const& s) { std::tie(state, opened_by) = s; }
+
+    auto currentState() const { return state; }
+
+    States<Closed, Open>      state     = Uninitialized{};
+    uint8_t const*            bell;
+    uint64_t                  opened_by = 0;
+    std::unique_ptr<uint64_t> opened_at = std::make_unique<uint64_t>(0);
+    std::function<uint64_t()> clock;
+  };
+
+  static_assert(!has_checkpoint<Counter>::value);
+  static_assert(has_checkpoint<Door>::value);
+
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    uint8_t bell = 0;
+    Counter c;
+    Door    d;
+    d.bell = &bell;
+
+    auto sim = SimBuilder<>().add(c).add(d).time_skipping(skipping).get_sim();
+    d.clock  = [&] { return sim.now(); };
+
+    sim.run_for(50);
+    auto after_setup = sim.checkpoint();
+
+    // nobody rings, the door gives up
+    sim.run_for(200);
+    REQUIRE(d.opened_by == 2);
+    REQUIRE(*d.opened_at == 100);
+    REQUIRE(c.count == 49); // ticks 5, 10, ..., 245
+    auto log = c.log;
+
+    // back to tick 50, timers, OneOf and all
+    sim.restore(after_setup);
+    REQUIRE(sim.now() == 50);
+    REQUIRE(c.count == 9);
+    REQUIRE(d.opened_by == 0);
+
+    // the bell belongs to us, not to a machine
+    bell = 1;
+    sim.poke();
+    sim.run_for(200);
+    REQUIRE(d.opened_by == 1);
+    REQUIRE(*d.opened_at == 50);
+    REQUIRE(c.log == log); // and the timeout was cancelled
+    REQUIRE(sim.now() == 250);
+
+    // same as the first time around
+    sim.restore(after_setup);
+    bell = 0;
+    sim.poke();
+    sim.run_for(200);
+    REQUIRE(d.opened_by == 2);
+    REQUIRE(*d.opened_at == 100);
+    REQUIRE(c.log == log);
+  }
+}
+
+TEST_CASE("record and replay", "[libsim]")
+{
+  using Trace = std::vector<std::pair<uint64_t, uint64_t>>;
+
+  // flips `out` after 1, 2, 3, 4, 1, 2... ticks
+  struct Pinger {
+    MAKE_STATE(Low);
+    MAKE_STATE(High);
+
+    Events transition(Uninitialized, InitEvent) {
+      state = Low{};
+      return next();
+    }
+
+    Events transition(Low, Timeout)  { state = High{}; out = 1; return next(); }
+    Events transition(High, Timeout) { state = Low{};  out = 0; return next(); }
+
+    Events next() { return Only{Timeout{1 + flips++ % 4}}; }
+
+    auto currentState() const { return state; }
+
+    States<Low, High> state = Uninitialized{};
+    uint8_t           out   = 0;
+    uint64_t          flips = 0;
+  };
+
+  // catches flips, and takes a breather whenever they stop for a while
+  struct Catcher {
+    MAKE_STATE(Catching);
+    MAKE_STATE(Resting);
+
+    Events transition(Uninitialized, InitEvent) {
+      if (lazy) return resting();
+      return catching();
+    }
+
+    Events transition(Catching, RisingEdge e)  { return caught(e.user_id); }
+    Events transition(Catching, FallingEdge e) { return caught(e.user_id); }
+
+    Events transition(Catching, Timeout) {
+      trace.emplace_back(clock(), 0);
+      return resting();
+    }
+
+    Events transition(Resting, Timeout) { return catching(); }
+
+    Events caught(uint64_t how) {
+      trace.emplace_back(clock(), how);
+      return catching();
+    }
+
+    Events catching() {
+      state = Catching{};
+      return OneOf{RisingEdge{in, 1}, FallingEdge{in, 2}, Timeout{3, 3}};
+    }
+
+    Events resting() {
+      state = Resting{};
+      return Only{Timeout{2}};
+    }
+
+    auto currentState() const { return state; }
+
+    States<Catching, Resting> state = Uninitialized{};
+    uint8_t const*            in;
+    bool                      lazy  = false;
+    std::function<uint64_t()> clock;
+    Trace                     trace;
+  };
+
+  struct Pair {
+    Pinger  pinger;
+    Catcher catcher;
+  };
+
+  // Records (to) or replays (from) two pairs, each in its own group so
+  // threads are allowed
+  auto run = [](Recorder* to, Playback* from, size_t threads, bool lazy = false) {
+    std::array<Pair, 2> pairs;
+    for (Pair& p : pairs) {
+      p.catcher.in   = &p.pinger.out;
+      p.catcher.lazy = lazy;
+    }
+
+    auto sim = SimBuilder<>()
+      .add(pairs[0].pinger, MachineGroup{0}).add(pairs[0].catcher, MachineGroup{0})
+      .add(pairs[1].pinger, MachineGroup{1}).add(pairs[1].catcher, MachineGroup{1})
+      .threads(threads).get_sim();
+    for (Pair& p : pairs) p.catcher.clock = [&] { return sim.now(); };
+
+    sim.record(to);
+    auto stats = from ? sim.replay(*from) : sim.run_for(1000);
+    return std::make_pair(stats.events,
+                          std::vector<Trace>{pairs[0].catcher.trace, pairs[1].catcher.trace});
+  };
+
+  Recorder memory;
+  auto     recorded = run(&memory, nullptr, 1);
+  REQUIRE(memory.count() == recorded.first);
+  REQUIRE(recorded.second[0].size() > 250);
+  REQUIRE(std::any_of(recorded.second[0].begin(), recorded.second[0].end(),
+                      [](auto& t) { return t.second == 0; }));
+
+  // small, and the same no matter where it went or how many threads made it
+  auto bytes = memory.bytes();
+  REQUIRE(bytes.size() < 8 * recorded.first);
+
+  std::stringstream stream;
+  {
+    Recorder to_stream(stream);
+    REQUIRE(run(&to_stream, nullptr, 2) == recorded);
+  }
+  REQUIRE(stream.str() == std::string(bytes.begin(), bytes.end()));
+
+  // the same transitions, with nobody looking at `out`
+  Playback playback(stream);
+  REQUIRE(run(nullptr, &playback, 1) == recorded);
+
+  // a catcher that starts out resting doesn't do what was recorded
+  Playback lazy(bytes);
+  REQUIRE_THROWS_WITH(run(nullptr, &lazy, 1, true),
+                      Catch::Contains("replay diverged"));
+
+  std::stringstream garbage("definitely not a recording");
+  REQUIRE_THROWS_AS(Playback(garbage), std::runtime_error);
+  bytes.pop_back();
+  Playback cut(bytes);
+  REQUIRE_THROWS_WITH(run(nullptr, &cut, 1), "recording is cut short");
+}
+
+TEST_CASE("no stats unless asked for", "[libsim]")
+{
+  // see teststats.cpp for the other way around
+  struct Idle {
+    Events transition(Uninitialized, InitEvent) { return None{}; }
+    auto   currentState() const { return state; }
+    States<> state = Uninitialized{};
+  };
+
+  Idle i;
+  auto sim = SimBuilder<>().add(i).get_sim();
+  static_assert(std::is_same_v<std::decay_t<decltype(sim.stats())>, NoStats>);
+
+  std::ostringstream json;
+  sim.dump_stats(json);
+  REQUIRE(json.str() == "{\"enabled\": false}\n");
+}
@@ -0,0 +1,142 @@
+// Stats are all or nothing for a whole build, and the rest of the tests run
+// without them. Only this file's simulators have them, and none of its
+// machines are used anywhere else
+#define LIBSIM_STATS
+
+#include "../../catch/catch.hpp"
+
+#include "../Simulator.h"
+
+#include <functional>
+#include <sstream>
+
+using namespace libsim;
+
+namespace {
+
+// Flips `out` every `period` ticks
+struct Flipper {
+  MAKE_STATE(Flipping);
+
+  Events transition(Uninitialized, InitEvent) {
+    state = Flipping{};
+    return Only{Timeout{period}};
+  }
+
+  Events transition(Flipping, Timeout) {
+    out ^= 1;
+    return Only{Timeout{period}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Flipping> state  = Uninitialized{};
+  uint64_t         period = 4;
+  uint8_t          out    = 0;
+};
+
+// Waits for `in` to go up, or gives up after 10 ticks and waits some more
+struct Waiter {
+  MAKE_STATE(Waiting);
+  MAKE_STATE(Sulking);
+
+  Events transition(Uninitialized, InitEvent) { return wait(); }
+  Events transition(Waiting, RisingEdge)      { return wait(); }
+
+  Events transition(Waiting, Timeout) {
+    state = Sulking{};
+    return Only{Timeout{5}};
+  }
+
+  Events transition(Sulking, Timeout) { return wait(); }
+
+  Events wait() {
+    state = Waiting{};
+    return OneOf{RisingEdge{in}, Timeout{10}};
+  }
+
+  auto currentState() const { return state; }
+
+  States<Waiting, Sulking> state = Uninitialized{};
+  uint8_t const*           in;
+};
+
+} // namespace
+
+TEST_CASE("stats", "[libsim]")
+{
+  for (bool skipping : {false, true}) {
+    INFO((skipping ? "skipping" : "not skipping"));
+
+    Flipper fast, slow;
+    Waiter  a, b;
+    slow.period = 32;
+    a.in        = &fast.out;
+    b.in        = &slow.out;
+
+    auto sim = SimBuilder<>().add(fast).add(slow).add(a).add(b)
+      .time_skipping(skipping).get_sim();
+    sim.run_for(600);
+
+    // The last machine added comes first, each one gets a row per state
+    // (Uninitialized too) with a column per event kind
+    constexpr size_t kinds = std::variant_size_v<SimpleEvent>;
+    constexpr size_t init = 0, timeout = 1, rising = 2;
+    std::array<size_t, 4> base = {0, 3 * kinds, 6 * kinds, 8 * kinds}; // b a slow fast
+
+    SimStats const& stats = sim.stats();
+    auto count = [&](size_t machine, size_t state, size_t kind) {
+      return stats.transitions[base[machine] + state * kinds + kind];
+    };
+
+    REQUIRE(stats.transitions.size() == 10 * kinds);
+    REQUIRE(count(3, 1, timeout) == 149); // every 4 ticks
+    REQUIRE(count(2, 1, timeout) == 18);  // every 32
+
+    // a always sees fast go up before it gives up, on the tick after
+    REQUIRE(count(1, 1, rising)  == 75);
+    REQUIRE(count(1, 1, timeout) == 0);
+
+    // b gives up a lot, but still catches all 9 of slow's
+    uint64_t b_sulks = count(0, 1, timeout);
+    REQUIRE(count(0, 1, rising) == 9);
+    REQUIRE(b_sulks > 9);
+    REQUIRE(count(0, 2, timeout) == b_sulks);
+
+    // InitEvent isn't fired by the scheduler
+    for (size_t m = 0; m < 4; ++m) REQUIRE(count(m, 0, init) == 0);
+
+    uint64_t total = 0;
+    for (uint64_t n : stats.transitions) total += n;
+    REQUIRE(total == 149 + 18 + 75 + 9 + 2 * b_sulks);
+
+    // whatever fires first out of a waiter's OneOf cancels the other one
+    REQUIRE(stats.cancellations == 75 + 9 + b_sulks);
+
+    // Watchers get looked at when they're new and whenever the value
+    // changes, only rising edges go off
+    REQUIRE(stats.hits == 75 + 9);
+    REQUIRE(stats.evaluations > 2 * stats.hits);
+
+    // a timer per flipper, an edge and a timer per waiter, the whole time
+    REQUIRE(stats.max_depth == 6);
+    REQUIRE(stats.depth.size() == 1);
+    REQUIRE(stats.depth[0] == std::pair<uint64_t, uint64_t>(0, 6));
+
+    uint64_t polls = 0;
+    for (uint64_t n : stats.poll_ns) polls += n;
+    REQUIRE(polls == stats.polls);
+    if (skipping) REQUIRE(stats.polls < 600);
+    else          REQUIRE(stats.polls == 600);
+
+    std::ostringstream json;
+    sim.dump_stats(json);
+    INFO(json.str());
+    REQUIRE(json.str().find("\"enabled\": true") != std::string::npos);
+    REQUIRE(json.str().find("{\"machine\": 3, \"state\": \"Flipping\", "
+                            "\"event\": \"Timeout\", \"count\": 149}") != std::string::npos);
+    REQUIRE(json.str().find("{\"machine\": 0, \"state\": \"Sulking\", "
+                            "\"event\": \"Timeout\", \"count\": ") != std::string::npos);
+    REQUIRE(json.str().find("\"samples\": [[0, 6]]") != std::string::npos);
+  }
+}
@@ -7,7 +7,7 @@ IFLAGS             := -isystem/usr/share/verilator/include/ -I${BUILD_DIR}
 CXXFLAGS           := -std=c++17 -Wall -Wextra -Werror -O3 -c -g ${IFLAGS} \
 	                  -Wno-unused-local-typedefs
 VERILATOR_CXXFLAGS := -std=c++17 -O3 -c -isystem/usr/share/verilator/include/
-LDFLAGS            := -lfmt
+LDFLAGS            := -lfmt -pthread
 
 all: bin
 
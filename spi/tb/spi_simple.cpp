@@ -1,89 +1,112 @@
 #include "../catch/catch.hpp"
-#include "../common/common.h"
 
 #include "../libsim/Simulator.h"
+#include "../libsim/Sweep.h"
 
 #include "verilog/spi.hvv"
 
 #include <verilated_vcd_c.h>
 #include <fmt/format.h>
 #include <algorithm>
+#include <optional>
 
 using namespace libsim;
 
+// Clocks a verilated model, from inside the simulator (see ClockSource) so
+// an edge doesn't cost a transition. Not a machine, it goes in with
+//
+//   SimBuilder<>().clock(m.clock()).add(...)
+//
+// and stops clocking once `done` is set. Other clock domains of the same
+// model (see input) go in the same way, and edges of different domains that
+// land on the same tick share a single eval().
 template <typename Module>
 class VMachine
 {
 public:
-  MAKE_STATE(Running);
-  MAKE_STATE(Terminated);
-
+  // Traces to logs/<test name>.vcd
   VMachine(Module* mod,
            bool const& done,
            uint64_t clock_rate)
+    : VMachine(mod, done, clock_rate, trace_name())
+  { }
+
+  // Traces to logs/<trace>.vcd, or nowhere if trace is empty. Doesn't touch
+  // Catch, so this one is fine to use from sweep() jobs
+  VMachine(Module* mod,
+           bool const& done,
+           uint64_t clock_rate,
+           std::string trace)
     : mod_(mod)
     , done_(&done)
     , clkrt_(clock_rate)
-    , now_(0)
-    , tracer_(new VerilatedVcdC)
-    , state_(Uninitialized{})
   {
-    // also should be > 1?
-    if (!is_pow_two(clock_rate)) { // probably overly restrictive but whatever
-      throw std::runtime_error("clock rate not power of two");
-    }
+    if (trace.empty()) return;
 
+    tracer_.reset(new VerilatedVcdC);
     Verilated::traceEverOn(true);
 
     // attach tracer, must happen before opening the file for some reason
     mod->trace(tracer_.get(), 99);
 
     // do the thing
-    std::string name = fmt::format("logs/{}.vcd",
-        Catch::getResultCapture().getCurrentTestName());
+    std::string name = fmt::format("logs/{}.vcd", trace);
     std::replace(name.begin(), name.end(), ' ', '_');
     Verilated::mkdir("logs");
     tracer_->open(name.c_str());
   }
 
   ~VMachine() {
-    tracer_->close();
+    if (tracer_) tracer_->close();
   }
 
-  Events transition(Uninitialized, InitEvent) {
-    // Poll on a timer until done
-    state_ = Running{};
-    return OneOf{
-      Timeout{clkrt_/2},
-      RisingEdge{done_},
-    };
+  // clk flips every clock_rate ticks, the first time halfway through
+  ClockSource clock() {
+    ClockSource c;
+    c.signal      = &mod_->clk;
+    c.half_period = clkrt_;
+    c.phase       = clkrt_ / 2;
+    c.ctx         = this;
+    c.stop        = done_;
+    c.on_edge     = edge;
+    return c;
   }
 
-  Events transition(Running, Timeout) {
-    mod_->clk = ~mod_->clk;
-    mod_->eval();
-    tracer_->dump(now_);
-    now_ += 1;
-    return OneOf{
-      Timeout{clkrt_},
-      RisingEdge{done_},
-    };
+  // Another clock on one of the model's inputs, SCK say. half_period and
+  // phase are in 1/divisor ticks, so it doesn't have to be a multiple of
+  // clk. Stops once `stop` is set
+  ClockSource input(uint8_t*    signal,
+                    uint64_t    half_period,
+                    uint64_t    divisor,
+                    uint64_t    phase,
+                    bool const& stop) {
+    ClockSource c;
+    c.signal      = signal;
+    c.half_period = half_period;
+    c.phase       = phase;
+    c.divisor     = divisor;
+    c.ctx         = this;
+    c.stop        = &stop;
+    c.on_edge     = edge;
+    return c;
   }
 
-  Events transition(Running, RisingEdge) {
-    // once here, nothing will ever trigger again
-    return None{};
+private:
+  // traces are timestamped in ticks, whichever clock(s) went
+  static void edge(void* self, uint64_t tick) {
+    auto* m = static_cast<VMachine*>(self);
+    m->mod_->eval();
+    if (m->tracer_) m->tracer_->dump(tick);
   }
 
-  auto currentState() const { return state_; }
+  static std::string trace_name() {
+    return Catch::getResultCapture().getCurrentTestName();
+  }
 
-private:
   Module*                        mod_;
   bool const*                    done_;
   uint64_t                       clkrt_;
-  uint64_t                       now_;
   std::unique_ptr<VerilatedVcdC> tracer_;
-  States<Running, Terminated>    state_;
 };
 
 TEST_CASE("slave does nothing when not selected", "[spi]")
@@ -92,7 +115,7 @@ TEST_CASE("slave does nothing when not selected", "[spi]")
   bool                 done(false);
   VMachine<spi>        m(s.get(), done, 1);
 
-  auto sim = SimBuilder<>().add(m).get_sim();
+  auto sim = SimBuilder<>().clock(m.clock()).get_sim();
 
   s->SSEL = 0; // FIXME actually selection works differently than this
 
@@ -116,7 +139,7 @@ namespace t1 {
 
       curr_bit = 8; // msb first
       state = SendingClockDown{}; // next timeout will trigger a rising edge
-      return Only{Timeout{10}};
+      return Only{Timeout{half_period}};
     }
 
     Events transition(SendingClockDown, Timeout) {
@@ -130,30 +153,76 @@ namespace t1 {
 
       state     = SendingClockUp{};
       curr_bit -= 1; // msb goes first
-      return Only{Timeout{10}};
+      return Only{Timeout{half_period}};
     }
 
     Events transition(SendingClockUp, Timeout) {
       s->SCK  = 0;
       s->MOSI = 0;
       state = SendingClockDown{};
-      return Only{Timeout{10}};
+      return Only{Timeout{half_period}};
     }
 
-    Master(spi* s, uint32_t value)
+    Master(spi* s, uint32_t value, uint64_t half_period = 10)
       : s(s)
       , value(value)
+      , half_period(half_period)
     { }
 
-    spi*    s;
-    uint8_t value;
-    size_t  curr_bit;
+    spi*     s;
+    uint8_t  value;
+    uint64_t half_period; // of SCK
+    size_t   curr_bit;
 
     // state machine junk
     auto currentState() const { return state; }
     States<SendingClockUp, SendingClockDown, Done> state;
   };
 
+  // Master that only posts bits, SCK is a clock of its own (see
+  // VMachine::input). A new bit goes out after every falling edge, and SCK is
+  // told to stop after the 8th one, before it can go up again
+  struct ClockedMaster {
+    MAKE_STATE(Sending);
+
+    Events transition(Uninitialized, InitEvent) {
+      s->SSEL = 1;
+
+      curr_bit = 7; // msb first
+      s->MOSI  = (value >> curr_bit) & 1;
+      state    = Sending{};
+      return Only{FallingEdge{&(s->SCK)}};
+    }
+
+    Events transition(Sending, FallingEdge) {
+      if (curr_bit == 0) {
+        s->MOSI  = 0;
+        sck_done = true;
+        return None{};
+      }
+
+      curr_bit -= 1;
+      s->MOSI   = (value >> curr_bit) & 1;
+      return Only{FallingEdge{&(s->SCK)}};
+    }
+
+    ClockedMaster(spi* s, uint8_t value)
+      : s(s)
+      , value(value)
+    { }
+
+    spi*     s;
+    uint8_t  value;
+    unsigned curr_bit;
+    bool     sck_done = false;
+
+    // state machine junk
+    auto currentState() const { return state; }
+    States<Sending> state;
+  };
+
+  // Writes down what it got instead of REQUIRE-ing it right away, so it can
+  // be used from sweep() jobs too. Timing out counts as done
   struct Slave {
     MAKE_STATE(WaitingForData);  // told module to post a result somewhere
     MAKE_STATE(WaitingForClock); // waiting for fpga posedge
@@ -162,7 +231,7 @@ namespace t1 {
     Events transition(Uninitialized, InitEvent) {
       static_assert(sizeof(s->out) == sizeof(uint8_t), "!");
 
-      CHECK(s->out_avail == 0);
+      early = s->out_avail != 0;
       state = WaitingForData{};
       return OneOf{
         RisingEdge{&(s->out_avail)}, // it worked
@@ -178,20 +247,25 @@ namespace t1 {
     }
 
     Events transition(WaitingForClock, Timeout) {
-      REQUIRE(s->out == value);
+      got   = s->out;
       state = Done{};
-      done = true;
+      done  = true;
       return None{};
     }
 
     Events transition(WaitingForData, Timeout) {
-      REQUIRE(!(bool)("timeout")); // test failed, we timedout
+      state = Done{}; // test failed, we timedout
+      done  = true;
       return None{};
     }
 
-    spi*    s;
-    uint8_t value;
-    bool&   done;
+    bool ok() const { return !early && got == value; }
+
+    spi*                   s;
+    uint8_t                value;
+    bool&                  done;
+    bool                   early = false; // out_avail was already up
+    std::optional<uint8_t> got;           // empty if it timed out
 
     Slave(spi* s, uint32_t value, bool& done)
       : s(s)
@@ -213,8 +287,109 @@ TEST_CASE("master -> slave, single", "[spi]")
   t1::Master           master(s.get(), 111);
   t1::Slave            slave(s.get(), 111, done);
 
-  auto sim = SimBuilder<>().add(m).add(master).add(slave).get_sim();
-  while (!done) sim.poll();
+  auto sim = SimBuilder<>().clock(m.clock()).add(master).add(slave)
+    .time_skipping() // everything watched is written by the machines
+    .get_sim();
+  sim.run_until([&] { return done; });
+
+  REQUIRE(!slave.early);
+  REQUIRE(slave.got == std::optional<uint8_t>(111));
+}
+
+TEST_CASE("master -> slave, every byte", "[spi][sweep]")
+{
+  // every value at a few clock rates and SCK speeds, each one its own model
+  // and simulator, all of them on however many cores there are
+  constexpr uint64_t clock_rates[]  = {1, 2, 4};
+  constexpr uint64_t half_periods[] = {20, 30, 40}; // >= 2.5 clocks, like the single one
+
+  struct Case {
+    uint8_t  value;
+    uint64_t clock_rate;
+    uint64_t half_period;
+  };
+
+  std::vector<Case> cases;
+  for (uint64_t rate : clock_rates) {
+    for (uint64_t half : half_periods) {
+      for (unsigned v = 0; v < 256; ++v) cases.push_back(Case{(uint8_t)v, rate, half});
+    }
+  }
+
+  auto results = sweep(cases.size(), [&](size_t i) {
+    Case const& c = cases[i];
+
+    std::unique_ptr<spi> s(new spi);
+    bool                 done(false);
+    VMachine<spi>        m(s.get(), done, c.clock_rate, ""); // no traces
+    t1::Master           master(s.get(), c.value, c.half_period);
+    t1::Slave            slave(s.get(), c.value, done);
+
+    auto sim = SimBuilder<>().clock(m.clock()).add(master).add(slave)
+      .time_skipping()
+      .get_sim();
+    sim.run_until([&] { return done; });
+    return slave.ok();
+  });
+
+  for (size_t i = 0; i < cases.size(); ++i) {
+    INFO("value " << (int)cases[i].value << ", clock rate " << cases[i].clock_rate
+         << ", SCK half period " << cases[i].half_period);
+    CHECK(results[i]);
+  }
+}
+
+TEST_CASE("master -> slave, SCK in its own clock domain", "[spi][sweep]")
+{
+  // clk at 12 MHz is a half period of 3 ticks, so SCK at num/den MHz is
+  // 36 * den / num ticks. Up to 2.4 MHz, the slave needs 2.5 clocks per
+  // half period of SCK
+  struct Ratio {
+    uint64_t num;
+    uint64_t den;
+  };
+  constexpr Ratio    sck_mhz[] = {{1, 1}, {3, 2}, {2, 1}, {11, 5}, {12, 5}};
+  constexpr uint64_t offsets[] = {0, 1, 3}; // SCK's first edge after clk's, in ticks
+
+  struct Case {
+    uint8_t  value;
+    Ratio    sck;
+    uint64_t offset;
+  };
+
+  std::vector<Case> cases;
+  for (Ratio sck : sck_mhz) {
+    for (uint64_t offset : offsets) {
+      for (unsigned v = 0; v < 256; ++v) cases.push_back(Case{(uint8_t)v, sck, offset});
+    }
+  }
+
+  auto results = sweep(cases.size(), [&](size_t i) {
+    Case const& c = cases[i];
+
+    std::unique_ptr<spi> s(new spi);
+    bool                 done(false);
+    VMachine<spi>        m(s.get(), done, 3, ""); // no traces
+    t1::ClockedMaster    master(s.get(), c.value);
+    t1::Slave            slave(s.get(), c.value, done);
+
+    // SCK starts low and goes up a half period in, MOSI is already there
+    uint64_t half = 36 * c.sck.den;
+    uint64_t div  = c.sck.num;
+    auto sck = m.input(&s->SCK, half, div, half + c.offset * div, master.sck_done);
+
+    auto sim = SimBuilder<>().clock(m.clock()).clock(sck).add(master).add(slave)
+      .time_skipping()
+      .get_sim();
+    sim.run_until([&] { return done; });
+    return slave.ok();
+  });
+
+  for (size_t i = 0; i < cases.size(); ++i) {
+    INFO("value " << (int)cases[i].value << ", SCK " << cases[i].sck.num << "/"
+         << cases[i].sck.den << " MHz, offset " << cases[i].offset);
+    CHECK(results[i]);
+  }
 }
 
 namespace t2 {
@@ -341,6 +516,8 @@ TEST_CASE("slave -> master, single", "[spi]")
   t2::Master           master(s.get(), 111, done);
   t2::Slave            slave(s.get(), 111);
 
-  auto sim = SimBuilder<>().add(m).add(master).add(slave).get_sim();
-  while (!done) sim.poll();
+  auto sim = SimBuilder<>().clock(m.clock()).add(master).add(slave)
+    .time_skipping() // everything watched is written by the machines
+    .get_sim();
+  sim.run_until([&] { return done; });
 }